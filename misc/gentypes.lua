@@ -0,0 +1,25 @@
+-- Generate a synthetic C program with a large number of distinct
+-- types to benchmark how ohmd loads and resolves types.
+--
+-- usage: lua gentypes.lua [ntypes] > types.c
+--        cc -g -fno-eliminate-unused-debug-types -o types types.c
+--        time ohmd -D -o empty.ohm ./types
+--
+-- or simply run "make bench" in tests/.
+--
+-- Every struct refers to a type defined after it, so that the loader
+-- has to resolve forward references.
+
+local n = tonumber(arg[1]) or 100000
+
+for i = n-1, 0, -1 do
+   print(string.format("typedef struct s%d s%d_t;", i, i))
+end
+
+for i = 0, n-1 do
+   local next = (i+1 < n) and string.format("s%d_t *next;", i+1) or "void *next;"
+   print(string.format("struct s%d { int a[%d]; double b; %s };",
+                       i, (i % 7) + 1, next))
+end
+
+print("int main(void) { return 0; }")
@@ -0,0 +1,178 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ohmd.h"
+
+// Every chunk of an arena starts with a pointer to the previously
+// allocated chunk.
+typedef struct ohm_chunk_t ohm_chunk_t;
+struct ohm_chunk_t
+{
+    ohm_chunk_t *next;
+    size_t       size;
+};
+
+#define OHM_ARENA_ALIGN(n)  (((n) + 15) & ~((size_t)15))
+#define OHM_CHUNK_HDR       OHM_ARENA_ALIGN(sizeof(ohm_chunk_t))
+
+// allocate "size" zeroed bytes from an arena. The memory is never
+// moved, so pointers into the arena stay valid until it is freed.
+void *
+ohm_alloc(ohm_arena_t *arena, size_t size)
+{
+    ohm_chunk_t *c;
+    size_t csize;
+    void *p;
+
+    size = OHM_ARENA_ALIGN(size);
+    if (!arena->chunks || (arena->used + size > arena->chunks->size)) {
+        csize = OHM_CHUNK_HDR + size;
+        if (csize < OHM_ARENA_CHUNK_SIZE)
+            csize = OHM_ARENA_CHUNK_SIZE;
+
+        c = calloc(1, csize);
+        if (!c) {
+            derror("unable to allocate memory.");
+            return NULL;
+        }
+        c->next = arena->chunks;
+        c->size = csize;
+        arena->chunks = c;
+        arena->used = OHM_CHUNK_HDR;
+    }
+
+    p = (char *)arena->chunks + arena->used;
+    arena->used += size;
+    return p;
+}
+
+// release all of the memory held by an arena.
+void
+ohm_arena_free(ohm_arena_t *arena)
+{
+    ohm_chunk_t *c, *next;
+
+    for (c = arena->chunks; c; c = next) {
+        next = c->next;
+        free(c);
+    }
+    arena->chunks = NULL;
+    arena->used = 0;
+}
+
+// make room for at least one more element in a growable array of
+// "*cap" elements of "elem_size" bytes each.
+void *
+ohm_grow(void *vec, unsigned int *cap, size_t elem_size)
+{
+    unsigned int ncap = *cap ? (*cap << 1) : 1024;
+
+    vec = realloc(vec, ncap * elem_size);
+    if (!vec) {
+        derror("unable to allocate memory.");
+        return NULL;
+    }
+    *cap = ncap;
+    return vec;
+}
+
+/**********************************************************************/
+
+// Interned strings. Symbol names repeat a lot across compile units
+// (think "int" or "i"), so we keep exactly one copy of each in an
+// arena and index them with an open-addressing hash set.
+
+static OHM_TLS ohm_arena_t   strings_arena;
+static OHM_TLS const char  **strings_index;
+static OHM_TLS unsigned int  strings_index_bits;
+static OHM_TLS unsigned int  strings_index_size;
+
+static inline unsigned int
+_str_hash(const char *s)
+{
+    unsigned int h = 2166136261U;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static void
+_strings_index_put(const char *s)
+{
+    unsigned int mask = (1U << strings_index_bits) - 1;
+    unsigned int slot = _str_hash(s) & mask;
+
+    while (strings_index[slot])
+        slot = (slot + 1) & mask;
+    strings_index[slot] = s;
+    strings_index_size++;
+}
+
+static int
+_strings_index_grow(void)
+{
+    const char **old = strings_index;
+    unsigned int i, oldbits = strings_index_bits;
+
+    strings_index_bits = oldbits ? oldbits + 1 : 12;
+    strings_index = calloc(1U << strings_index_bits, sizeof(*strings_index));
+    if (!strings_index) {
+        derror("unable to allocate memory.");
+        strings_index = old;
+        strings_index_bits = oldbits;
+        return -1;
+    }
+
+    strings_index_size = 0;
+    for (i = 0; old && i < (1U << oldbits); i++)
+        if (old[i])
+            _strings_index_put(old[i]);
+    free(old);
+    return 0;
+}
+
+// return the unique copy of the string "s".
+const char *
+ohm_intern(const char *s)
+{
+    unsigned int slot, mask;
+    size_t len;
+    char *p;
+
+    if (!s)
+        return NULL;
+
+    if (strings_index) {
+        mask = (1U << strings_index_bits) - 1;
+        for (slot = _str_hash(s) & mask; strings_index[slot];
+             slot = (slot + 1) & mask) {
+            if (!strcmp(s, strings_index[slot]))
+                return strings_index[slot];
+        }
+    }
+
+    if (((strings_index_size + 1) << 1) > (1U << strings_index_bits))
+        if (_strings_index_grow() < 0)
+            return NULL;
+
+    len = strlen(s) + 1;
+    p = ohm_alloc(&strings_arena, len);
+    if (!p)
+        return NULL;
+    memcpy(p, s, len);
+    _strings_index_put(p);
+    return p;
+}
@@ -0,0 +1,661 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+// glibc only declares realpath() with the X/Open or GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ohmd.h"
+
+// The symbol cache is a snapshot of the resolved types, variables and
+// functions tables of a binary. It only holds offsets (into the file)
+// and DIE offsets, never pointers, so that it can be mapped anywhere
+// and the tables rebuilt from it without touching the DWARF.
+//
+// Layout: header, types, type elements, functions, function ranges,
+// variables, location ranges, location ops, strings. The location
+// programs of the variables come first, then the frame bases of the
+// functions.
+
+#define OHM_CACHE_MAGIC     "OHMCACHE"
+#define OHM_CACHE_VERSION   3
+#define OHM_CACHE_NONE      UINT32_MAX
+#define OHM_CACHE_NOTYPE    UINT64_MAX
+
+typedef struct cache_hdr_t cache_hdr_t;
+struct cache_hdr_t
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t key;         // string offset of the key of the binary
+    uint32_t ntypes;
+    uint32_t nelems;
+    uint32_t nfns;
+    uint32_t nranges;
+    uint32_t nvars;
+    uint32_t nlocs;
+    uint32_t nops;
+    uint32_t pad;
+    uint64_t strsize;
+};
+
+typedef struct cache_type_t cache_type_t;
+struct cache_type_t
+{
+    uint64_t id;
+    uint64_t size;
+    uint32_t name;
+    uint32_t nelem;
+    uint32_t elems;       // index of the first element
+    uint32_t nelems;      // number of elements stored
+    int32_t  ohm_type;
+    uint32_t pad;
+};
+
+typedef struct cache_fn_t cache_fn_t;
+struct cache_fn_t
+{
+    uint64_t lowpc;
+    uint64_t hipc;
+    uint32_t name;
+    uint32_t loc;         // index of the first range of the frame base
+    uint32_t nlocs;
+    uint32_t pad;
+};
+
+typedef struct cache_range_t cache_range_t;
+struct cache_range_t
+{
+    uint64_t lowpc;
+    uint64_t hipc;
+    uint32_t fn;
+    uint32_t pad;
+};
+
+typedef struct cache_var_t cache_var_t;
+struct cache_var_t
+{
+    uint64_t addr;
+    uint64_t offset;
+    uint64_t type;        // DIE offset of the type
+    uint32_t name;
+    uint32_t function;    // string offset of the function name
+    uint32_t loctype;
+    uint32_t loc;         // index of the first location range
+    uint32_t nlocs;
+    uint32_t pad;
+};
+
+typedef struct cache_loc_t cache_loc_t;
+struct cache_loc_t
+{
+    uint64_t lowpc;
+    uint64_t hipc;
+    uint32_t ops;         // index of the first op
+    uint32_t nops;
+};
+
+typedef struct cache_op_t cache_op_t;
+struct cache_op_t
+{
+    int64_t  arg;
+    uint16_t op;
+    uint16_t reg;
+    uint32_t pad;
+};
+
+// directory to keep the symbol caches in
+static const char *cache_dir;
+
+void
+cache_set_dir(const char *dir)
+{
+    cache_dir = dir;
+}
+
+// get the path of the cache file for "file". The cache is keyed on the
+// build-id of the binary if it has one, and on its path, modification
+// time and size otherwise.
+static int
+_cache_path(const char *file, char *key, size_t ksize, char *path, size_t psize)
+{
+    struct stat st;
+    char rpath[PATH_MAX], *home;
+    unsigned long h;
+    char *s;
+
+    if (!cache_dir) {
+        if ((cache_dir = getenv("OHM_CACHE_DIR")) == NULL) {
+            home = getenv("HOME");
+            if (!home)
+                return -1;
+            snprintf(path, psize, "%s/.cache", home);
+            mkdir(path, 0755);
+            snprintf(path, psize, "%s/.cache/ohm", home);
+            cache_dir = strdup(path);
+        }
+    }
+    mkdir(cache_dir, 0755);
+
+    if (get_build_id(file, key, ksize) == 0) {
+        snprintf(path, psize, "%s/%s.ohmc", cache_dir, key);
+        return 0;
+    }
+
+    if (!realpath(file, rpath) || stat(rpath, &st) < 0)
+        return -1;
+
+    snprintf(key, ksize, "%s:%lu:%lu", rpath, (unsigned long)st.st_mtime,
+             (unsigned long)st.st_size);
+    h = 5381;
+    for (s = key; *s; s++)
+        h = (h << 5) + h + (unsigned char)*s;
+    snprintf(path, psize, "%s/%016lx.ohmc", cache_dir, h);
+    return 0;
+}
+
+/**********************************************************************/
+
+// string table of a cache being written
+typedef struct strtab_t strtab_t;
+struct strtab_t
+{
+    char         *buf;
+    unsigned int  size;
+    unsigned int  cap;
+};
+
+static uint32_t
+_strtab_add(strtab_t *st, const char *s)
+{
+    unsigned int len, off;
+    char *buf;
+
+    if (!s)
+        return OHM_CACHE_NONE;
+
+    len = strlen(s) + 1;
+    while (st->size + len > st->cap) {
+        buf = ohm_grow(st->buf, &st->cap, 1);
+        if (!buf)
+            return OHM_CACHE_NONE;
+        st->buf = buf;
+    }
+
+    off = st->size;
+    memcpy(st->buf + off, s, len);
+    st->size += len;
+    return off;
+}
+
+// number of elements of a type that are stored in the cache
+static inline unsigned int
+_type_nelems(basetype_t *t)
+{
+    if (!t->elems)
+        return 0;
+    return is_struct(t->ohm_type) ? t->nelem : 1;
+}
+
+// maps a function to its index in the functions table
+typedef struct fn_map_t fn_map_t;
+struct fn_map_t
+{
+    function_t   *fn;
+    unsigned int  index;
+};
+
+static int
+_fn_map_cmp(const void *a, const void *b)
+{
+    const function_t *f1 = ((fn_map_t *)a)->fn, *f2 = ((fn_map_t *)b)->fn;
+    return (f1 < f2) ? -1 : (f1 > f2);
+}
+
+// count the ranges and ops of a location program
+static void
+_count_loclist(loclist_t *loc, uint32_t *nlocs, uint32_t *nops)
+{
+    unsigned int i;
+
+    if (!loc)
+        return;
+    *nlocs += loc->nranges;
+    for (i = 0; i < loc->nranges; i++)
+        *nops += loc->ranges[i].nops;
+}
+
+// write the ranges of a location program, whose ops start at "*nops"
+static void
+_write_loc_ranges(FILE *fp, loclist_t *loc, unsigned int *nops)
+{
+    cache_loc_t cl;
+    unsigned int i;
+
+    for (i = 0; loc && i < loc->nranges; i++) {
+        memset(&cl, 0, sizeof(cl));
+        cl.lowpc = loc->ranges[i].lowpc;
+        cl.hipc = loc->ranges[i].hipc;
+        cl.ops = *nops;
+        cl.nops = loc->ranges[i].nops;
+        *nops += cl.nops;
+        fwrite(&cl, sizeof(cl), 1, fp);
+    }
+}
+
+static void
+_write_loc_ops(FILE *fp, loclist_t *loc)
+{
+    cache_op_t co;
+    loc_range_t *r;
+    unsigned int i, k;
+
+    for (i = 0; loc && i < loc->nranges; i++) {
+        r = &loc->ranges[i];
+        for (k = 0; k < r->nops; k++) {
+            memset(&co, 0, sizeof(co));
+            co.arg = r->ops[k].arg;
+            co.op = r->ops[k].op;
+            co.reg = r->ops[k].reg;
+            fwrite(&co, sizeof(co), 1, fp);
+        }
+    }
+}
+
+// write the symbol tables to the cache for "file"
+int
+cache_save(const char *file)
+{
+    char key[PATH_MAX+64], path[PATH_MAX], tmp[PATH_MAX+32];
+    cache_hdr_t hdr;
+    cache_type_t ct;
+    cache_fn_t cf;
+    cache_range_t cr;
+    cache_var_t cv;
+    strtab_t st = { NULL, 0, 0 };
+    fn_map_t *fns = NULL, *pf, key_fn;
+    fn_range_t *ranges;
+    basetype_t *t;
+    variable_t *v;
+    uint64_t id;
+    unsigned int i, j, nranges, nlocs, nops;
+    FILE *fp;
+
+    if (_cache_path(file, key, sizeof(key), path, sizeof(path)) < 0)
+        return -1;
+
+    // we write to a temporary file first so that concurrent readers
+    // never see a partial cache.
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        ddebug("unable to write symbol cache %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+
+    nranges = get_function_ranges(&ranges);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, OHM_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = OHM_CACHE_VERSION;
+    hdr.key = _strtab_add(&st, key);
+    hdr.ntypes = types_table_size;
+    for (i = 0; i < types_table_size; i++)
+        hdr.nelems += _type_nelems(types_table[i]);
+    hdr.nfns = fns_table_size;
+    hdr.nranges = nranges;
+    hdr.nvars = vars_table_size;
+    for (i = 0; i < vars_table_size; i++)
+        _count_loclist(vars_table[i]->loc, &hdr.nlocs, &hdr.nops);
+    for (i = 0; i < fns_table_size; i++)
+        _count_loclist(fns_table[i]->frame_base, &hdr.nlocs, &hdr.nops);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    for (i = 0, j = 0; i < types_table_size; i++) {
+        t = types_table[i];
+        memset(&ct, 0, sizeof(ct));
+        ct.id = t->id;
+        ct.size = t->size;
+        ct.name = _strtab_add(&st, t->name);
+        ct.nelem = t->nelem;
+        ct.ohm_type = t->ohm_type;
+        ct.elems = j;
+        ct.nelems = _type_nelems(t);
+        j += ct.nelems;
+        fwrite(&ct, sizeof(ct), 1, fp);
+    }
+
+    for (i = 0; i < types_table_size; i++) {
+        t = types_table[i];
+        for (j = 0; j < _type_nelems(t); j++) {
+            id = t->elems[j] ? t->elems[j]->id : OHM_CACHE_NOTYPE;
+            fwrite(&id, sizeof(id), 1, fp);
+        }
+    }
+
+    // the ranges refer to functions by their index in the table
+    fns = malloc((fns_table_size + 1) * sizeof(*fns));
+    if (!fns)
+        goto error;
+    for (i = 0; i < fns_table_size; i++) {
+        fns[i].fn = fns_table[i];
+        fns[i].index = i;
+    }
+    qsort(fns, fns_table_size, sizeof(*fns), _fn_map_cmp);
+
+    // the frame bases come after the location programs of all of the
+    // variables.
+    for (i = 0, nlocs = 0; i < vars_table_size; i++)
+        nlocs += vars_table[i]->loc ? vars_table[i]->loc->nranges : 0;
+
+    for (i = 0; i < fns_table_size; i++) {
+        memset(&cf, 0, sizeof(cf));
+        cf.lowpc = fns_table[i]->lowpc;
+        cf.hipc = fns_table[i]->hipc;
+        cf.name = _strtab_add(&st, fns_table[i]->name);
+        cf.loc = nlocs;
+        cf.nlocs = fns_table[i]->frame_base ? fns_table[i]->frame_base->nranges : 0;
+        nlocs += cf.nlocs;
+        fwrite(&cf, sizeof(cf), 1, fp);
+    }
+
+    for (i = 0; i < nranges; i++) {
+        memset(&cr, 0, sizeof(cr));
+        cr.lowpc = ranges[i].lowpc;
+        cr.hipc = ranges[i].hipc;
+        key_fn.fn = ranges[i].fn;
+        pf = bsearch(&key_fn, fns, fns_table_size, sizeof(*fns), _fn_map_cmp);
+        if (!pf)
+            goto error;
+        cr.fn = pf->index;
+        fwrite(&cr, sizeof(cr), 1, fp);
+    }
+
+    // the struct members hoisted out of a variable share its location
+    // program, but each gets a copy of it in the cache.
+    for (i = 0, nlocs = 0; i < vars_table_size; i++) {
+        v = vars_table[i];
+        memset(&cv, 0, sizeof(cv));
+        cv.addr = v->addr;
+        cv.offset = v->offset;
+        cv.type = v->type->id;
+        cv.name = _strtab_add(&st, v->name);
+        cv.function = v->function ? _strtab_add(&st, v->function->name)
+                                  : OHM_CACHE_NONE;
+        cv.loctype = v->loctype;
+        cv.loc = nlocs;
+        cv.nlocs = v->loc ? v->loc->nranges : 0;
+        nlocs += cv.nlocs;
+        fwrite(&cv, sizeof(cv), 1, fp);
+    }
+
+    nops = 0;
+    for (i = 0; i < vars_table_size; i++)
+        _write_loc_ranges(fp, vars_table[i]->loc, &nops);
+    for (i = 0; i < fns_table_size; i++)
+        _write_loc_ranges(fp, fns_table[i]->frame_base, &nops);
+
+    for (i = 0; i < vars_table_size; i++)
+        _write_loc_ops(fp, vars_table[i]->loc);
+    for (i = 0; i < fns_table_size; i++)
+        _write_loc_ops(fp, fns_table[i]->frame_base);
+
+    fwrite(st.buf, 1, st.size, fp);
+    hdr.strsize = st.size;
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+
+    if (ferror(fp) || fclose(fp) != 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        free(fns);
+        free(st.buf);
+        return -1;
+    }
+
+    ddebug("wrote symbol cache %s.", path);
+    free(fns);
+    free(st.buf);
+    return 0;
+
+error:
+    fclose(fp);
+    unlink(tmp);
+    free(fns);
+    free(st.buf);
+    return -1;
+}
+
+/**********************************************************************/
+
+// check that the "n" location ranges starting at "first", and their
+// ops, are all in the cache. The sums are done on 64 bits so that they
+// cannot wrap around.
+static bool
+_check_loclist(cache_hdr_t *hdr, cache_loc_t *cl, uint32_t first, uint32_t n)
+{
+    unsigned int i;
+
+    if ((uint64_t)first + n > hdr->nlocs)
+        return false;
+    for (i = 0; i < n; i++)
+        if ((uint64_t)cl[first+i].ops + cl[first+i].nops > hdr->nops)
+            return false;
+    return true;
+}
+
+// check that all of the offsets and counts in the cache are within
+// its tables, before any of them is used.
+static bool
+_check_cache(cache_hdr_t *hdr, cache_type_t *ct, cache_fn_t *cf,
+             cache_range_t *cr, cache_var_t *cv, cache_loc_t *cl)
+{
+    unsigned int i;
+
+    if (hdr->key >= hdr->strsize)
+        return false;
+
+    for (i = 0; i < hdr->ntypes; i++)
+        if ((ct[i].name >= hdr->strsize) ||
+            ((uint64_t)ct[i].elems + ct[i].nelems > hdr->nelems))
+            return false;
+
+    for (i = 0; i < hdr->nfns; i++)
+        if ((cf[i].name >= hdr->strsize) ||
+            !_check_loclist(hdr, cl, cf[i].loc, cf[i].nlocs))
+            return false;
+
+    for (i = 0; i < hdr->nranges; i++)
+        if (cr[i].fn >= hdr->nfns)
+            return false;
+
+    for (i = 0; i < hdr->nvars; i++)
+        if ((cv[i].name >= hdr->strsize) ||
+            ((cv[i].function != OHM_CACHE_NONE) &&
+             (cv[i].function >= hdr->strsize)) ||
+            !_check_loclist(hdr, cl, cv[i].loc, cv[i].nlocs))
+            return false;
+    return true;
+}
+
+// rebuild the location program of "n" ranges starting at "first",
+// which _check_cache made sure are in the cache.
+static int
+_read_loclist(cache_loc_t *cl, cache_op_t *co, uint32_t first, uint32_t n,
+              loclist_t **loc)
+{
+    loc_range_t *r;
+    unsigned int i, k;
+
+    *loc = NULL;
+    if (!n)
+        return 0;
+    if (!(*loc = new_loclist(n)))
+        return -1;
+
+    for (i = 0; i < n; i++) {
+        r = &(*loc)->ranges[i];
+        r->lowpc = cl[first+i].lowpc;
+        r->hipc = cl[first+i].hipc;
+        r->nops = cl[first+i].nops;
+        if (!(r->ops = new_loc_ops(r->nops)))
+            return -1;
+        for (k = 0; k < r->nops; k++) {
+            r->ops[k].op = co[cl[first+i].ops+k].op;
+            r->ops[k].reg = co[cl[first+i].ops+k].reg;
+            r->ops[k].arg = co[cl[first+i].ops+k].arg;
+        }
+    }
+    return 0;
+}
+
+// load the symbol tables from the cache for "file". Returns 1 if the
+// tables were loaded, 0 if there is no (valid) cache for the file.
+int
+cache_load(const char *file)
+{
+    char key[PATH_MAX+64], path[PATH_MAX];
+    struct stat sb;
+    cache_hdr_t *hdr;
+    cache_type_t *ct;
+    uint64_t *elems;
+    cache_fn_t *cf;
+    cache_range_t *cr;
+    cache_var_t *cv;
+    cache_loc_t *cl;
+    cache_op_t *co;
+    const char *strs;
+    basetype_t *t, **tel;
+    function_t **fns = NULL;
+    variable_t v;
+    size_t size;
+    unsigned int i, j;
+    char *base;
+    int fd;
+
+    if (_cache_path(file, key, sizeof(key), path, sizeof(path)) < 0)
+        return 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(*hdr)) {
+        close(fd);
+        return 0;
+    }
+
+    base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return 0;
+
+    hdr = (cache_hdr_t *)base;
+    if (hdr->strsize > sb.st_size)
+        goto invalid;
+    size = sizeof(*hdr) + hdr->ntypes * sizeof(*ct) + hdr->nelems * sizeof(*elems)
+        + hdr->nfns * sizeof(*cf) + hdr->nranges * sizeof(*cr)
+        + hdr->nvars * sizeof(*cv) + hdr->nlocs * sizeof(*cl)
+        + hdr->nops * sizeof(*co) + hdr->strsize;
+    if (memcmp(hdr->magic, OHM_CACHE_MAGIC, sizeof(hdr->magic)) ||
+        hdr->version != OHM_CACHE_VERSION || size != sb.st_size ||
+        !hdr->strsize)
+        goto invalid;
+
+    ct = (cache_type_t *)(hdr + 1);
+    elems = (uint64_t *)(ct + hdr->ntypes);
+    cf = (cache_fn_t *)(elems + hdr->nelems);
+    cr = (cache_range_t *)(cf + hdr->nfns);
+    cv = (cache_var_t *)(cr + hdr->nranges);
+    cl = (cache_loc_t *)(cv + hdr->nvars);
+    co = (cache_op_t *)(cl + hdr->nlocs);
+    strs = (const char *)(co + hdr->nops);
+    if ((strs[hdr->strsize-1] != 0) ||
+        !_check_cache(hdr, ct, cf, cr, cv, cl) || strcmp(strs + hdr->key, key))
+        goto invalid;
+
+    // the names are used in place; the mapping is never released.
+    tel = malloc((hdr->nelems + 1) * sizeof(*tel));
+    fns = malloc((hdr->nfns + 1) * sizeof(*fns));
+    if (!tel || !fns)
+        goto error;
+
+    for (i = 0; i < hdr->ntypes; i++) {
+        t = get_or_add_type(ct[i].id);
+        if (!t)
+            goto error;
+        t->size = ct[i].size;
+        t->name = strs + ct[i].name;
+        t->nelem = ct[i].nelem;
+        t->ohm_type = ct[i].ohm_type;
+        t->elems = ct[i].nelems ? &tel[ct[i].elems] : NULL;
+    }
+
+    for (i = 0; i < hdr->ntypes; i++)
+        for (j = 0; j < ct[i].nelems; j++)
+            tel[ct[i].elems+j] = (elems[ct[i].elems+j] == OHM_CACHE_NOTYPE)
+                ? NULL : get_type(elems[ct[i].elems+j]);
+
+    for (i = 0; i < hdr->nfns; i++) {
+        fns[i] = add_function(strs + cf[i].name, cf[i].lowpc, cf[i].hipc);
+        if (!fns[i] || (_read_loclist(cl, co, cf[i].loc, cf[i].nlocs,
+                                      &fns[i]->frame_base) < 0))
+            goto error;
+    }
+
+    for (i = 0; i < hdr->nranges; i++)
+        if (add_function_range(fns[cr[i].fn], cr[i].lowpc, cr[i].hipc) < 0)
+            goto error;
+
+    for (i = 0; i < hdr->nvars; i++) {
+        memset(&v, 0, sizeof(v));
+        v.name = strs + cv[i].name;
+        v.type = get_type(cv[i].type);
+        v.function = (cv[i].function == OHM_CACHE_NONE)
+            ? NULL : get_function((char *)strs + cv[i].function);
+        v.loctype = cv[i].loctype;
+        v.addr = cv[i].addr;
+        v.offset = cv[i].offset;
+        if (_read_loclist(cl, co, cv[i].loc, cv[i].nlocs, &v.loc) < 0)
+            goto error;
+        if (!add_variable(&v))
+            goto error;
+    }
+
+    mark_types_resolved();
+    resolve_functions();
+    index_variables();
+    free(fns);
+    ddebug("loaded symbols from cache %s.", path);
+    return 1;
+
+invalid:
+    ddebug("ignoring stale or corrupt symbol cache %s.", path);
+    munmap(base, sb.st_size);
+    return 0;
+
+error:
+    // the tables are half-built at this point.
+    derror("error loading symbol cache %s.", path);
+    free(fns);
+    return -1;
+}
@@ -9,9 +9,35 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "ohmd.h"
 
+#ifndef DW_AT_dwo_name
+#define DW_AT_dwo_name      0x76
+#endif
+
+#ifndef DW_AT_GNU_dwo_name
+#define DW_AT_GNU_dwo_name  0x2130
+#endif
+
+#ifndef DW_OP_addrx
+#define DW_OP_addrx             0xa1
+#endif
+
+#ifndef DW_OP_constx
+#define DW_OP_constx            0xa2
+#endif
+
+#ifndef DW_OP_GNU_addr_index
+#define DW_OP_GNU_addr_index    0xfb
+#endif
+
+#ifndef DW_OP_GNU_const_index
+#define DW_OP_GNU_const_index   0xfc
+#endif
+
 int
 is_location_form(int form)
 {
@@ -72,6 +98,7 @@ get_child_name(Dwarf_Debug dbg, Dwarf_Die child, char *name, int size)
         return -1;
 
     strncpy(name, cname, size);
+    name[size-1] = 0;
     dwarf_dealloc(dbg, cname, DW_DLA_STRING);
     return 0;
 }
@@ -96,6 +123,7 @@ get_parent_name(Dwarf_Debug dbg, Dwarf_Die parent, char *name, int size)
         return -1;
 
     strncpy(name, pname, size);
+    name[size-1] = 0;
     dwarf_dealloc(dbg, pname, DW_DLA_STRING);
     return 0;
 }
@@ -107,8 +135,8 @@ get_offset_tid(Dwarf_Die die, Dwarf_Off *offset, Dwarf_Unsigned *tid)
     Dwarf_Error err;
     Dwarf_Attribute attr;
 
-    // get the offset
-    ret = dwarf_die_CU_offset(die, offset, &err);
+    // get the section-global offset
+    ret = dwarf_dieoffset(die, offset, &err);
     if (ret == DW_DLV_ERROR)
         return -1;
 
@@ -118,12 +146,37 @@ get_offset_tid(Dwarf_Die die, Dwarf_Off *offset, Dwarf_Unsigned *tid)
         return -1;
 
     if (ret == DW_DLV_OK)
-        if ((dwarf_formref(attr, tid, &err)) != DW_DLV_OK)
+        if ((dwarf_global_formref(attr, tid, &err)) != DW_DLV_OK)
             return -1;
 
     return 0;
 }
 
+int
+get_cu_base_address(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Addr *base)
+{
+    int ret;
+    Dwarf_Error err;
+    Dwarf_Off cu_offset;
+    Dwarf_Die cu_die;
+
+    ret = dwarf_CU_dieoffset_given_die(die, &cu_offset, &err);
+    if (ret != DW_DLV_OK)
+        return -1;
+
+    ret = dwarf_offdie(dbg, cu_offset, &cu_die, &err);
+    if (ret != DW_DLV_OK)
+        return -1;
+
+    ret = dwarf_lowpc(cu_die, base, &err);
+    dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+    if (ret == DW_DLV_NO_ENTRY) {
+        *base = 0;
+        return 0;
+    }
+    return (ret == DW_DLV_OK) ? 0 : -1;
+}
+
 int
 get_member_location(Dwarf_Die die, Dwarf_Unsigned *loc)
 {
@@ -142,6 +195,44 @@ get_member_location(Dwarf_Die die, Dwarf_Unsigned *loc)
     return 0;
 }
 
+int
+resolve_addr_indexes(Dwarf_Die die, Dwarf_Locdesc *ld)
+{
+    int i, ret;
+    Dwarf_Error err;
+    Dwarf_Addr addr;
+    Dwarf_Loc *op;
+
+    for (i = 0; i < ld->ld_cents; i++) {
+        op = &ld->ld_s[i];
+        switch (op->lr_atom) {
+            case DW_OP_addrx:
+            case DW_OP_GNU_addr_index:
+            case DW_OP_constx:
+            case DW_OP_GNU_const_index:
+                break;
+            default:
+                continue;
+        }
+
+        // split units index the .debug_addr of their skeleton, which
+        // the split file is tied to.
+        ret = dwarf_debug_addr_index_to_addr(die, op->lr_number, &addr, &err);
+        if (ret != DW_DLV_OK) {
+            derror("error in dwarf_debug_addr_index_to_addr(%lu).",
+                   (unsigned long)op->lr_number);
+            return -1;
+        }
+        if ((op->lr_atom == DW_OP_addrx) ||
+            (op->lr_atom == DW_OP_GNU_addr_index))
+            op->lr_atom = DW_OP_addr;
+        else
+            op->lr_atom = DW_OP_constu;
+        op->lr_number = addr;
+    }
+    return 0;
+}
+
 int
 traverse_die(dwarf_query_cb_t cb, Dwarf_Debug dbg, Dwarf_Die parent_die,
              Dwarf_Die child_die)
@@ -184,3 +275,149 @@ traverse_die(dwarf_query_cb_t cb, Dwarf_Debug dbg, Dwarf_Die parent_die,
     }
     return n;
 }
+
+// open a DWARF file, and tie it to the skeleton "tied" if it has split
+// units.
+static int
+_dwarf_open(const char *path, Dwarf_Debug tied, int *fd, Dwarf_Debug *dbg)
+{
+    Dwarf_Error err;
+
+    *fd = open(path, O_RDONLY);
+    if (*fd < 0) {
+        derror("error reading file %s.", path);
+        return -1;
+    }
+
+    if (dwarf_init(*fd, DW_DLC_READ, 0, 0, dbg, &err) != DW_DLV_OK) {
+        derror("dwarf_init() failed for %s.", path);
+        close(*fd);
+        return -1;
+    }
+
+    if (tied && (dwarf_set_tied_dbg(*dbg, tied, &err) != DW_DLV_OK)) {
+        derror("error in dwarf_set_tied_dbg() for %s.", path);
+        dwarf_finish(*dbg, &err);
+        close(*fd);
+        return -1;
+    }
+    return 0;
+}
+
+int
+dwarf_file_open(debuginfo_t *di, dwarf_file_t *f)
+{
+    Dwarf_Error err;
+
+    f->tied_fd = -1;
+    f->tied_dbg = 0;
+    if (!di->dwp[0])
+        return _dwarf_open(di->path, 0, &f->fd, &f->dbg);
+
+    // we read the units of the package, which need the skeleton.
+    if (_dwarf_open(di->path, 0, &f->tied_fd, &f->tied_dbg) < 0)
+        return -1;
+    if (_dwarf_open(di->dwp, f->tied_dbg, &f->fd, &f->dbg) < 0) {
+        dwarf_finish(f->tied_dbg, &err);
+        close(f->tied_fd);
+        return -1;
+    }
+    return 0;
+}
+
+void
+dwarf_file_close(dwarf_file_t *f)
+{
+    Dwarf_Error err;
+
+    dwarf_finish(f->dbg, &err);
+    close(f->fd);
+    if (f->tied_fd >= 0) {
+        dwarf_finish(f->tied_dbg, &err);
+        close(f->tied_fd);
+    }
+}
+
+int
+get_dwo_path(Dwarf_Die cu_die, debuginfo_t *di, char *path, size_t size)
+{
+    Dwarf_Error err;
+    Dwarf_Attribute attr;
+    char *name, *dir = NULL, *base;
+
+    if ((dwarf_attr(cu_die, DW_AT_dwo_name, &attr, &err) != DW_DLV_OK) &&
+        (dwarf_attr(cu_die, DW_AT_GNU_dwo_name, &attr, &err) != DW_DLV_OK))
+        return -1;
+    if (dwarf_formstring(attr, &name, &err) != DW_DLV_OK)
+        return -1;
+
+    // a relative name is relative to the compilation directory.
+    if ((name[0] != '/') &&
+        (dwarf_attr(cu_die, DW_AT_comp_dir, &attr, &err) == DW_DLV_OK))
+        dwarf_formstring(attr, &dir, &err);
+    snprintf(path, size, "%s%s%s", dir ? dir : "", dir ? "/" : "", name);
+
+    // the build tree might not be around where we run, so we also look
+    // next to the binary.
+    if (access(path, R_OK)) {
+        base = strrchr(name, '/');
+        snprintf(path, size, "%s/%s", di->dir, base ? base+1 : name);
+    }
+    return 0;
+}
+
+int
+scan_cu(dwarf_query_cb_t cb, debuginfo_t *di, Dwarf_Debug dbg,
+        Dwarf_Die cu_die, unsigned int cu)
+{
+    int n, fd;
+    char dwo[PATH_MAX];
+    Dwarf_Debug dwo_dbg;
+    Dwarf_Error err;
+    Dwarf_Off base = types_id_base;
+
+    if (!di || di->dwp[0] || (get_dwo_path(cu_die, di, dwo, sizeof(dwo)) < 0))
+        return traverse_die(cb, dbg, NULL, cu_die);
+
+    if (_dwarf_open(dwo, dbg, &fd, &dwo_dbg) < 0)
+        return 0;
+
+    // the DIE offsets of different .dwo files overlap as well.
+    types_id_base = base | ((Dwarf_Off)(cu + 1) << 32);
+    n = scan_cus(cb, NULL, dwo_dbg);
+    types_id_base = base;
+
+    dwarf_finish(dwo_dbg, &err);
+    close(fd);
+    return n;
+}
+
+int
+scan_cus(dwarf_query_cb_t cb, debuginfo_t *di, Dwarf_Debug dbg)
+{
+    int ret, n = 0;
+    unsigned int cu;
+    Dwarf_Error err;
+    Dwarf_Unsigned cu_hdr_len, abbr_off, next_cu_hdr;
+    Dwarf_Half ver_stamp, addr_sz;
+    Dwarf_Die cu_die;
+
+    for (cu = 0; ; cu++) {
+        ret = dwarf_next_cu_header(dbg, &cu_hdr_len, &ver_stamp, &abbr_off,
+                                   &addr_sz, &next_cu_hdr, &err);
+        if (ret == DW_DLV_ERROR) {
+            derror("error reading DWARF CU header.");
+            return -1;
+        } else if (ret == DW_DLV_NO_ENTRY)
+            break;
+
+        if (dwarf_siblingof(dbg, NULL, &cu_die, &err) == DW_DLV_ERROR) {
+            derror("error getting sibling of cu.");
+            continue;
+        }
+
+        n += scan_cu(cb, di, dbg, cu_die, cu);
+        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+    }
+    return n;
+}
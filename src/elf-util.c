@@ -0,0 +1,328 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+// glibc only declares realpath() with the X/Open or GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libelf.h>
+#include <gelf.h>
+
+#include "ohmd.h"
+
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+// where the separate debug files of the system live
+#define OHM_DEBUG_DIR "/usr/lib/debug"
+
+// open an ELF file for reading
+static Elf *
+_elf_open(const char *file, int *fd)
+{
+    Elf *elf;
+
+    if (elf_version(EV_CURRENT) == EV_NONE)
+        return NULL;
+
+    *fd = open(file, O_RDONLY);
+    if (*fd < 0)
+        return NULL;
+
+    elf = elf_begin(*fd, ELF_C_READ, NULL);
+    if (!elf) {
+        close(*fd);
+        return NULL;
+    }
+    return elf;
+}
+
+static void
+_elf_close(Elf *elf, int fd)
+{
+    elf_end(elf);
+    close(fd);
+}
+
+int
+get_build_id(const char *file, char *id, size_t size)
+{
+    int fd, ret = -1;
+    Elf *elf;
+    Elf_Scn *scn = NULL;
+    Elf_Data *data;
+    GElf_Shdr shdr;
+    GElf_Nhdr nhdr;
+    size_t off, noff, doff, i;
+    unsigned char *desc;
+
+    elf = _elf_open(file, &fd);
+    if (!elf)
+        return -1;
+
+    while (ret < 0 && (scn = elf_nextscn(elf, scn)) != NULL) {
+        if (!gelf_getshdr(scn, &shdr) || shdr.sh_type != SHT_NOTE)
+            continue;
+
+        data = elf_getdata(scn, NULL);
+        if (!data)
+            continue;
+
+        off = 0;
+        while ((off = gelf_getnote(data, off, &nhdr, &noff, &doff)) > 0) {
+            if (nhdr.n_type != NT_GNU_BUILD_ID || nhdr.n_namesz != 4 ||
+                memcmp((char *)data->d_buf + noff, "GNU", 4))
+                continue;
+
+            // the build-id is printed as a hex string
+            if (size < (nhdr.n_descsz << 1) + 1)
+                break;
+            desc = (unsigned char *)data->d_buf + doff;
+            for (i = 0; i < nhdr.n_descsz; i++)
+                sprintf(id + (i << 1), "%02x", desc[i]);
+            ret = 0;
+            break;
+        }
+    }
+
+    _elf_close(elf, fd);
+    return ret;
+}
+
+// get the entry point of an ELF file and the link-time address that
+// the start of the file is mapped at.
+int
+get_elf_load_info(const char *file, addr_t *entry, addr_t *base)
+{
+    int fd, ret = -1;
+    Elf *elf;
+    GElf_Ehdr ehdr;
+    GElf_Phdr phdr;
+    size_t nphdr, i;
+
+    elf = _elf_open(file, &fd);
+    if (!elf)
+        return -1;
+
+    if (!gelf_getehdr(elf, &ehdr) || (elf_getphdrnum(elf, &nphdr) != 0))
+        goto out;
+
+    *entry = ehdr.e_entry;
+    for (i = 0; i < nphdr; i++) {
+        if (!gelf_getphdr(elf, i, &phdr) || (phdr.p_type != PT_LOAD))
+            continue;
+        if ((ret < 0) || (phdr.p_vaddr - phdr.p_offset < *base))
+            *base = phdr.p_vaddr - phdr.p_offset;
+        ret = 0;
+    }
+
+out:
+    _elf_close(elf, fd);
+    return ret;
+}
+
+// get the size of the static TLS block of an ELF file, aligned as it
+// is below the thread pointer on x86-64.
+int
+get_elf_tls_size(const char *file, addr_t *size)
+{
+    int fd, ret = -1;
+    Elf *elf;
+    GElf_Phdr phdr;
+    size_t nphdr, i;
+    addr_t align;
+
+    elf = _elf_open(file, &fd);
+    if (!elf)
+        return -1;
+
+    if (elf_getphdrnum(elf, &nphdr) != 0)
+        goto out;
+
+    for (i = 0; i < nphdr; i++) {
+        if (!gelf_getphdr(elf, i, &phdr) || (phdr.p_type != PT_TLS))
+            continue;
+        align = phdr.p_align ? phdr.p_align : 1;
+        *size = (phdr.p_memsz + align - 1) & ~(align - 1);
+        ret = 0;
+        break;
+    }
+
+out:
+    _elf_close(elf, fd);
+    return ret;
+}
+
+// check whether an ELF file has a section called "name"
+bool
+elf_has_section(const char *file, const char *name)
+{
+    int fd;
+    bool found = false;
+    Elf *elf;
+    Elf_Scn *scn = NULL;
+    GElf_Shdr shdr;
+    size_t shstrndx;
+    char *sname;
+
+    elf = _elf_open(file, &fd);
+    if (!elf)
+        return false;
+
+    if (elf_getshdrstrndx(elf, &shstrndx) == 0) {
+        while (!found && (scn = elf_nextscn(elf, scn)) != NULL) {
+            if (!gelf_getshdr(scn, &shdr))
+                continue;
+            sname = elf_strptr(elf, shstrndx, shdr.sh_name);
+            found = (sname && !strcmp(sname, name));
+        }
+    }
+
+    _elf_close(elf, fd);
+    return found;
+}
+
+// get the name of the separate debug file from the .gnu_debuglink
+// section of an ELF file.
+static int
+_get_debuglink(const char *file, char *name, size_t size)
+{
+    int fd, ret = -1;
+    Elf *elf;
+    Elf_Scn *scn = NULL;
+    Elf_Data *data;
+    GElf_Shdr shdr;
+    size_t shstrndx;
+    char *sname;
+
+    elf = _elf_open(file, &fd);
+    if (!elf)
+        return -1;
+
+    if (elf_getshdrstrndx(elf, &shstrndx) != 0)
+        goto out;
+
+    while ((scn = elf_nextscn(elf, scn)) != NULL) {
+        if (!gelf_getshdr(scn, &shdr))
+            continue;
+        sname = elf_strptr(elf, shstrndx, shdr.sh_name);
+        if (!sname || strcmp(sname, ".gnu_debuglink"))
+            continue;
+
+        // the name is followed by padding and a CRC of the debug file.
+        data = elf_getdata(scn, NULL);
+        if (data && data->d_size && (strnlen(data->d_buf, data->d_size) < size)) {
+            strcpy(name, data->d_buf);
+            ret = 0;
+        }
+        break;
+    }
+
+out:
+    _elf_close(elf, fd);
+    return ret;
+}
+
+// check that "path" has the debug information of a binary with the
+// build-id "id". Rather than checksumming all of the debug file as
+// the debuglink CRC would have us do, we compare build-ids when both
+// files have one.
+static bool
+_is_debug_file(const char *path, const char *id)
+{
+    char did[128];
+
+    if (access(path, R_OK) || !elf_has_section(path, ".debug_info"))
+        return false;
+    if (id[0] && !get_build_id(path, did, sizeof(did)))
+        return !strcmp(id, did);
+    return true;
+}
+
+// format the path of a candidate debug file into di->path, and keep it
+// if it is a debug file for the build-id "id". A path too long for
+// di->path is not a candidate.
+static bool
+_try_debug_file(debuginfo_t *di, const char *id, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(di->path, sizeof(di->path), fmt, ap);
+    va_end(ap);
+    if ((n < 0) || (n >= (int)sizeof(di->path)) ||
+        !_is_debug_file(di->path, id)) {
+        di->path[0] = 0;
+        return false;
+    }
+    return true;
+}
+
+// find where the debug information of "file" lives: in the file itself,
+// or in a separate debug file found through its build-id or its
+// .gnu_debuglink. The split units of binaries built with -gsplit-dwarf
+// are either in a DWARF package next to the binary, or in .dwo files
+// named by each of its skeleton units.
+int
+find_debuginfo(const char *file, debuginfo_t *di)
+{
+    char id[128], link[NAME_MAX+1], dir[PATH_MAX], *p;
+    const char *debugdir;
+
+    memset(di, 0, sizeof(*di));
+    if (!realpath(file, dir))
+        strncpy(dir, file, sizeof(dir)-1);
+    p = dirname(dir);
+    if (p != dir)
+        memmove(dir, p, strlen(p)+1);
+    strncpy(di->dir, dir, sizeof(di->dir)-1);
+
+    debugdir = getenv("OHM_DEBUG_DIR");
+    if (!debugdir)
+        debugdir = OHM_DEBUG_DIR;
+    if (get_build_id(file, id, sizeof(id)) < 0)
+        id[0] = 0;
+
+    if (elf_has_section(file, ".debug_info"))
+        strncpy(di->path, file, sizeof(di->path)-1);
+
+    if (!di->path[0] && id[0])
+        _try_debug_file(di, id, "%s/.build-id/%.2s/%s.debug",
+                        debugdir, id, id+2);
+
+    if (!di->path[0] && !_get_debuglink(file, link, sizeof(link))) {
+        // these are the places gdb looks in, in order.
+        if (!_try_debug_file(di, id, "%s/%s", dir, link) &&
+            !_try_debug_file(di, id, "%s/.debug/%s", dir, link))
+            _try_debug_file(di, id, "%s%s/%s", debugdir, dir, link);
+    }
+
+    if (!di->path[0])
+        return -1;
+
+    snprintf(di->dwp, sizeof(di->dwp), "%s.dwp", file);
+    if (access(di->dwp, R_OK))
+        di->dwp[0] = 0;
+
+    if (strcmp(di->path, file))
+        ddebug("reading the debug information of %s from %s.", file, di->path);
+    return 0;
+}
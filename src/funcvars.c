@@ -17,251 +17,434 @@
 #include "ohmd.h"
 
 // Variable table
-variable_t   vars_table[OHM_MAX_NUM_VARS];
-unsigned int vars_table_size;
+OHM_TLS variable_t **vars_table;
+OHM_TLS unsigned int vars_table_size;
+static OHM_TLS unsigned int vars_table_cap;
+
+// Variables before this index have been resolved already.
+static OHM_TLS unsigned int vars_resolved;
 
 // Function table
-function_t   fns_table[OHM_MAX_NUM_FUNCTIONS];
-unsigned int fns_table_size;
+OHM_TLS function_t **fns_table;
+OHM_TLS unsigned int fns_table_size;
+static OHM_TLS unsigned int fns_table_cap;
+
+// Variables and functions live in an arena so that pointers to them
+// stay valid as the tables grow.
+static OHM_TLS ohm_arena_t symbols_arena;
 
 // The "main" function
 function_t  *main_fn;
 
+// Open-addressing index over a symbol table keyed by the symbol
+// name. Each slot caches the hash of the name so that most probes
+// along a chain are rejected without a string comparison.
+typedef struct name_slot_t name_slot_t;
+struct name_slot_t
+{
+    unsigned int hash;
+    unsigned int index;   // table index plus one, zero if empty.
+};
+
+typedef struct name_index_t name_index_t;
+struct name_index_t
+{
+    name_slot_t  *slots;
+    unsigned int  bits;
+    unsigned int  size;
+    const char *(*name)(unsigned int i);
+};
+
+static const char *
+_var_name(unsigned int i)
+{
+    return vars_table[i]->name;
+}
+
+static const char *
+_fn_name(unsigned int i)
+{
+    return fns_table[i]->name;
+}
+
+static OHM_TLS name_index_t vars_index = { .name = _var_name };
+static OHM_TLS name_index_t fns_index = { .name = _fn_name };
+
+// FNV-1a hash of a symbol name
+static inline unsigned int
+_name_hash(const char *name)
+{
+    unsigned int h = 2166136261U;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static int
+_name_index_find(name_index_t *idx, const char *name, unsigned int hash)
+{
+    unsigned int slot, mask;
+    name_slot_t *s;
+
+    if (!idx->slots)
+        return -1;
+
+    mask = (1U << idx->bits) - 1;
+    for (slot = hash & mask; idx->slots[slot].index; slot = (slot + 1) & mask) {
+        s = &idx->slots[slot];
+        if (s->hash == hash && !strcmp(name, idx->name(s->index-1)))
+            return s->index-1;
+    }
+    return -1;
+}
+
+static void
+_name_index_put(name_index_t *idx, unsigned int hash, unsigned int i)
+{
+    unsigned int mask = (1U << idx->bits) - 1;
+    unsigned int slot = hash & mask;
+
+    while (idx->slots[slot].index)
+        slot = (slot + 1) & mask;
+    idx->slots[slot].hash = hash;
+    idx->slots[slot].index = i + 1;
+    idx->size++;
+}
+
+// add the i-th symbol to the index. The first symbol with a given name
+// wins, as it did when we looked up the tables linearly.
+static int
+_name_index_add(name_index_t *idx, unsigned int i)
+{
+    const char *name = idx->name(i);
+    unsigned int j, hash = _name_hash(name);
+    name_slot_t *old = idx->slots;
+    unsigned int oldbits = idx->bits;
+
+    if (_name_index_find(idx, name, hash) >= 0)
+        return 0;
+
+    // keep the index at most half full
+    if (((idx->size + 1) << 1) > (1U << idx->bits)) {
+        idx->bits = idx->bits ? idx->bits + 1 : 10;
+        idx->slots = calloc(1U << idx->bits, sizeof(*idx->slots));
+        if (!idx->slots) {
+            derror("unable to allocate memory.");
+            idx->slots = old;
+            idx->bits = oldbits;
+            return -1;
+        }
+        idx->size = 0;
+        for (j = 0; old && j < (1U << oldbits); j++)
+            if (old[j].index)
+                _name_index_put(idx, old[j].hash, old[j].index-1);
+        free(old);
+    }
+
+    _name_index_put(idx, hash, i);
+    return 1;
+}
+
+static void
+_name_index_clear(name_index_t *idx)
+{
+    free(idx->slots);
+    idx->slots = NULL;
+    idx->bits = 0;
+    idx->size = 0;
+}
+
 // get a variable object for a variable given its name
 variable_t*
 get_variable(char *name)
 {
-    int i;
-    for (i = 0; i < vars_table_size; i++) {
-        if (!strcmp(name, vars_table[i].name))
-            return &vars_table[i];
-    }
-    return NULL;
+    int i = _name_index_find(&vars_index, name, _name_hash(name));
+    return (i < 0) ? NULL : vars_table[i];
 }
 
 // get the function object for a function given its name
 function_t*
 get_function(char *name)
 {
-    int i;
-    for (i = 0; i < fns_table_size; i++) {
-        if (!strcmp(name, fns_table[i].name))
-            return &fns_table[i];
+    int i = _name_index_find(&fns_index, name, _name_hash(name));
+    return (i < 0) ? NULL : fns_table[i];
+}
+
+static int
+_vars_table_push(variable_t *var)
+{
+    variable_t **table;
+
+    if (vars_table_size == vars_table_cap) {
+        table = ohm_grow(vars_table, &vars_table_cap, sizeof(*table));
+        if (!table)
+            return -1;
+        vars_table = table;
     }
-    return NULL;
+    vars_table[vars_table_size++] = var;
+    return 0;
+}
+
+// add a copy of the variable "v" to the variables table
+variable_t *
+add_variable(variable_t *v)
+{
+    variable_t *var;
+
+    var = ohm_alloc(&symbols_arena, sizeof(*var));
+    if (!var)
+        return NULL;
+    *var = *v;
+    if (_vars_table_push(var) < 0)
+        return NULL;
+    return var;
+}
+
+static int
+_fns_table_push(function_t *f)
+{
+    function_t **table;
+
+    if (fns_table_size == fns_table_cap) {
+        table = ohm_grow(fns_table, &fns_table_cap, sizeof(*table));
+        if (!table)
+            return -1;
+        fns_table = table;
+    }
+    fns_table[fns_table_size] = f;
+    return _name_index_add(&fns_index, fns_table_size++);
+}
+
+// add a function spanning [lowpc, hipc) to the functions table. Its
+// code ranges are added separately with add_function_range.
+function_t *
+add_function(const char *name, addr_t lowpc, addr_t hipc)
+{
+    function_t *f;
+
+    f = ohm_alloc(&symbols_arena, sizeof(*f));
+    if (!f)
+        return NULL;
+    f->name = name;
+    f->lowpc = lowpc;
+    f->hipc = hipc;
+    if (_fns_table_push(f) < 0)
+        return NULL;
+    return f;
 }
 
 void
 print_all_variables(void)
 {
-    int i;
-    for (i = 0; i < vars_table_size; i++)
-        ddebug("%d> %s (%s) at 0x%lx (tid: %d)", i, vars_table[i].name,
-               is_addr(vars_table[i].loctype) ? "GLOBAL" : "STACK",
-               is_addr(vars_table[i].loctype) ? vars_table[i].addr : vars_table[i].offset,
-               vars_table[i].type->id);
+    unsigned int i;
+    variable_t *v;
+
+    for (i = 0; i < vars_table_size; i++) {
+        v = vars_table[i];
+        ddebug("%u> %s (%s) at 0x%lx (tid: 0x%lx)", i, v->name,
+               is_addr(v->loctype) ? "GLOBAL" : "STACK",
+               is_addr(v->loctype) ? v->addr : v->offset,
+               v->type ? (unsigned long)v->type->id : 0UL);
+    }
 }
 
 void
 print_all_functions(void)
 {
-    int i;
+    unsigned int i;
+
     for (i = 0; i < fns_table_size; i++)
-        ddebug("%d> %s 0x%lx-0x%lx", i, fns_table[i].name,
-               fns_table[i].lowpc, fns_table[i].hipc);
+        ddebug("%u> %s 0x%lx-0x%lx", i, fns_table[i]->name,
+               fns_table[i]->lowpc, fns_table[i]->hipc);
+}
+
+// Function ranges, sorted on their lowpc by resolve_functions.
+static OHM_TLS fn_range_t   *fns_ranges;
+static OHM_TLS unsigned int  fns_ranges_size;
+static OHM_TLS unsigned int  fns_ranges_cap;
+
+// get the code ranges of all of the functions
+unsigned int
+get_function_ranges(fn_range_t **ranges)
+{
+    *ranges = fns_ranges;
+    return fns_ranges_size;
+}
+
+int
+add_function_range(function_t *f, addr_t lowpc, addr_t hipc)
+{
+    fn_range_t *r;
+
+    if (fns_ranges_size == fns_ranges_cap) {
+        r = ohm_grow(fns_ranges, &fns_ranges_cap, sizeof(*r));
+        if (!r)
+            return -1;
+        fns_ranges = r;
+    }
+
+    r = &fns_ranges[fns_ranges_size++];
+    r->lowpc = lowpc;
+    r->hipc = hipc;
+    r->fn = f;
+    return 0;
+}
+
+// add a function whose code is described by the range list at offset
+// "rngoff" in .debug_ranges.
+static int
+_add_function_ranges(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Unsigned rngoff,
+                     loclist_t *frame_base)
+{
+    Dwarf_Ranges *ranges;
+    Dwarf_Signed nranges, i;
+    Dwarf_Unsigned nbytes;
+    Dwarf_Addr base, b;
+    Dwarf_Error err;
+    function_t *f;
+    addr_t lowpc, hipc;
+    char name[128];
+    int ret;
+
+    ret = dwarf_get_ranges_a(dbg, rngoff, die, &ranges, &nranges, &nbytes, &err);
+    if (ret == DW_DLV_ERROR) {
+        derror("error in dwarf_get_ranges_a()");
+        return -1;
+    } else if (ret == DW_DLV_NO_ENTRY)
+        return 0;
+
+    // range list entries are relative to the base address of the CU.
+    if (get_cu_base_address(dbg, die, &base) < 0)
+        base = 0;
+
+    if (get_child_name(dbg, die, name, sizeof(name)) < 0)
+        name[0] = 0;
+
+    // find the bounds of the function first
+    lowpc = ~0UL;
+    hipc = 0;
+    for (i = 0, b = base; i < nranges; i++) {
+        if (ranges[i].dwr_type == DW_RANGES_ADDRESS_SELECTION) {
+            b = ranges[i].dwr_addr2;
+        } else if (ranges[i].dwr_type == DW_RANGES_ENTRY) {
+            if (ranges[i].dwr_addr1 == ranges[i].dwr_addr2)
+                continue;
+            if (b + ranges[i].dwr_addr1 < lowpc)
+                lowpc = b + ranges[i].dwr_addr1;
+            if (b + ranges[i].dwr_addr2 > hipc)
+                hipc = b + ranges[i].dwr_addr2;
+        } else
+            break;
+    }
+
+    if (!hipc)
+        goto out;
+
+    f = add_function(ohm_intern(name), lowpc, hipc);
+    if (!f) {
+        ret = -1;
+        goto out;
+    }
+    f->frame_base = frame_base;
+
+    for (i = 0, b = base; i < nranges; i++) {
+        if (ranges[i].dwr_type == DW_RANGES_ADDRESS_SELECTION) {
+            b = ranges[i].dwr_addr2;
+        } else if (ranges[i].dwr_type == DW_RANGES_ENTRY) {
+            if (ranges[i].dwr_addr1 == ranges[i].dwr_addr2)
+                continue;
+            if (add_function_range(f, b + ranges[i].dwr_addr1,
+                                   b + ranges[i].dwr_addr2) < 0) {
+                ret = -1;
+                goto out;
+            }
+        } else
+            break;
+    }
+
+out:
+    dwarf_ranges_dealloc(dbg, ranges, nranges);
+    return (ret < 0) ? -1 : 1;
+}
+
+static int
+_fn_range_cmp(const void *a, const void *b)
+{
+    const fn_range_t *r1 = a, *r2 = b;
+    if (r1->lowpc != r2->lowpc)
+        return (r1->lowpc < r2->lowpc) ? -1 : 1;
+    return (r1->hipc < r2->hipc) ? -1 : (r1->hipc > r2->hipc);
+}
+
+// sort the function ranges so that we can map an ip to its function
+// with a binary search.
+void
+resolve_functions(void)
+{
+    qsort(fns_ranges, fns_ranges_size, sizeof(*fns_ranges), _fn_range_cmp);
+    main_fn = get_function("main");
+}
+
+// get the function whose code spans the given "ip"
+function_t*
+get_function_by_pc(unsigned long ip)
+{
+    unsigned int lo = 0, hi = fns_ranges_size, mid;
+
+    // find the last range starting at or below ip
+    while (lo < hi) {
+        mid = lo + ((hi - lo) >> 1);
+        if (fns_ranges[mid].lowpc <= ip)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo && (ip < fns_ranges[lo-1].hipc))
+        return fns_ranges[lo-1].fn;
+    return NULL;
 }
 
 // check if the given "ip" spans within the given function f
 inline int
 in_function(function_t *f, unsigned long ip)
 {
-    return (f && ((ip >= f->lowpc) && (ip < f->hipc)));
+    return (f && ((ip >= f->lowpc) && (ip < f->hipc))
+            && (get_function_by_pc(ip) == f));
 }
 
 // check if the given "ip" is in the "main()" function
 inline int
 in_main(unsigned long ip)
 {
-    if (!main_fn)
-        main_fn = get_function("main");
     return in_function(main_fn, ip);
 }
 
+// compile the location of a variable. A variable we cannot find is
+// no reason to give up on the rest of them; it is left without a
+// location and never read.
 int
 add_var_location(variable_t *var, Dwarf_Debug dbg, Dwarf_Die die,
                  Dwarf_Attribute attr, Dwarf_Half form)
 {
-    Dwarf_Locdesc *llbuf = 0, **llbufarray = 0;
-    Dwarf_Signed nelem;
-    Dwarf_Error err;
-    int i, ret = DW_DLV_ERROR, k;
-    Dwarf_Half nops = 0;
-    Dwarf_Unsigned opd1;
-    signed long stack[32];
-    int si;
+    int ret;
 
     if (!var)
         return -1;
 
-    si = 0;
-    stack[si] = 0;
-    stack[++si] = 0;
+    USED(form);
     var->loctype = 0;
     var->addr = 0;
+    var->offset = 0;
+    var->loc = NULL;
 
-    ret = dwarf_loclist_n(attr, &llbufarray, &nelem, &err);
-    if (ret == DW_DLV_ERROR) {
-        derror("error in dwarf_loclist_n().");
-        return -1;
-    } else if (ret == DW_DLV_NO_ENTRY)
+    ret = compile_loclist(dbg, die, attr, &var->loc, &var->addr);
+    if (ret < 0)
         return 0;
 
-    for (i = 0; i < nelem; ++i) {
-        llbuf = llbufarray[i];
-        nops = llbuf->ld_cents;
-        for (k = 0; k < nops; k++) {
-            Dwarf_Loc *expr = &llbuf->ld_s[k];
-            Dwarf_Small op = expr->lr_atom;
-            opd1 = expr->lr_number;
-
-            switch (op) {
-                case DW_OP_addr:
-                    var->loctype = OHM_ADDRESS;
-                    stack[++si] = opd1;
-                    break;
-                case DW_OP_fbreg:
-                    var->loctype = OHM_FBREG;
-                    stack[++si] = opd1;
-                    break;
-                case DW_OP_reg0:
-                case DW_OP_reg1:
-                case DW_OP_reg2:
-                case DW_OP_reg3:
-                case DW_OP_reg4:
-                case DW_OP_reg5:
-                case DW_OP_reg6:
-                case DW_OP_reg7:
-                case DW_OP_reg8:
-                case DW_OP_reg9:
-                case DW_OP_reg10:
-                case DW_OP_reg11:
-                case DW_OP_reg12:
-                case DW_OP_reg13:
-                case DW_OP_reg14:
-                case DW_OP_reg15:
-                case DW_OP_reg16:
-                case DW_OP_reg17:
-                case DW_OP_reg18:
-                case DW_OP_reg19:
-                case DW_OP_reg20:
-                case DW_OP_reg21:
-                case DW_OP_reg22:
-                case DW_OP_reg23:
-                case DW_OP_reg24:
-                case DW_OP_reg25:
-                case DW_OP_reg26:
-                case DW_OP_reg27:
-                case DW_OP_reg28:
-                case DW_OP_reg29:
-                case DW_OP_reg30:
-                case DW_OP_reg31:
-                    var->loctype = OHM_REG;
-                    stack[++si] = (opd1 - DW_OP_reg0);
-                    break;
-                case DW_OP_lit0:
-                case DW_OP_lit1:
-                case DW_OP_lit2:
-                case DW_OP_lit3:
-                case DW_OP_lit4:
-                case DW_OP_lit5:
-                case DW_OP_lit6:
-                case DW_OP_lit7:
-                case DW_OP_lit8:
-                case DW_OP_lit9:
-                case DW_OP_lit10:
-                case DW_OP_lit11:
-                case DW_OP_lit12:
-                case DW_OP_lit13:
-                case DW_OP_lit14:
-                case DW_OP_lit15:
-                case DW_OP_lit16:
-                case DW_OP_lit17:
-                case DW_OP_lit18:
-                case DW_OP_lit19:
-                case DW_OP_lit20:
-                case DW_OP_lit21:
-                case DW_OP_lit22:
-                case DW_OP_lit23:
-                case DW_OP_lit24:
-                case DW_OP_lit25:
-                case DW_OP_lit26:
-                case DW_OP_lit27:
-                case DW_OP_lit28:
-                case DW_OP_lit29:
-                case DW_OP_lit30:
-                case DW_OP_lit31:
-                    var->loctype = OHM_LITERAL;
-                    stack[++si] = (opd1 - DW_OP_lit0);
-                    break;
-                case DW_OP_stack_value:
-                    // the previos OP must have set the literal correctly,
-                    // so we simply continue.
-                    continue;
-                case DW_OP_deref:
-                    break;
-
-                case DW_OP_const1u:
-                case DW_OP_const2u:
-                case DW_OP_const4u:
-                case DW_OP_const8u:
-                case DW_OP_constu:
-                    stack[++si] = opd1;
-                    break;
-
-                case DW_OP_const1s:
-                case DW_OP_const2s:
-                case DW_OP_const4s:
-                case DW_OP_consts:
-                    stack[++si] = opd1;
-                    break;
-
-                case DW_OP_dup:
-                    stack[si+1] = stack[si];
-                    si++;
-                    break;
-                case DW_OP_plus:
-                    stack[si-1] += stack[si];
-                    si--;
-                    break;
-                case DW_OP_plus_uconst:
-                    stack[si] += opd1;
-                    break;
-                case DW_OP_minus:
-                    stack[si-1] -= stack[si];
-                    si--;
-                    break;
-                case DW_OP_GNU_push_tls_address:
-                    stack[si]++;
-                    break;
-                default:
-                    derror("DWARF-4 is not fully supported. Unsupported OP (0x%x).", op);
-                    return -1;
-            }
-        }
-
-        dwarf_dealloc(dbg, llbufarray[i]->ld_s, DW_DLA_LOC_BLOCK);
-        dwarf_dealloc(dbg, llbufarray[i], DW_DLA_LOCDESC);
-    }
-
-    if (is_addr(var->loctype) || is_reg(var->loctype) || is_literal(var->loctype))
-        var->addr = (Dwarf_Addr) stack[si];
-    else if (is_fbreg(var->loctype))
-        var->offset = (Dwarf_Signed) stack[si];
-    else {
-        derror("Unknown DWARF location type. OP (0x%x)", llbufarray[0]->ld_s[0].lr_atom);
-        return -1;
-    }
-    dwarf_dealloc(dbg, llbufarray, DW_DLA_LIST);
+    var->loctype = ret ? OHM_ADDRESS : OHM_LOCEXPR;
     return 1;
 }
 
@@ -269,7 +452,7 @@ int
 add_var_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die child_die)
 {
     int ret = DW_DLV_ERROR;
-    char pname[64], cname[64];
+    char pname[64], cname[64], name[128];
     Dwarf_Error err = 0;
     Dwarf_Off offset = 0;
     Dwarf_Half tag = 0, attrcode, form;
@@ -277,10 +460,15 @@ add_var_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die child_die)
     Dwarf_Signed attrcount, i;
     Dwarf_Unsigned bsz = 0;
     Dwarf_Addr lowpc = 0, highpc = 0;
-    variable_t *var;
+    Dwarf_Unsigned rngoff = 0;
+    variable_t v, *var = &v;
+    function_t *f = NULL;
+    loclist_t *frame_base = NULL;
+    addr_t fbaddr;
     int saw_lopc;
     int saw_hipc;
-    size_t size;
+    int saw_ranges;
+    int hipc_is_offset = 0;
 
     ret = dwarf_tag(child_die, &tag, &err);
     if (ret != DW_DLV_OK) {
@@ -298,7 +486,8 @@ add_var_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die child_die)
 
     switch (tag) {
         case DW_TAG_variable:
-            var = &vars_table[vars_table_size];
+            memset(var, 0, sizeof(*var));
+            var->name = "";
             for (i = 0; i < attrcount; ++i) {
                 if (dwarf_whatattr(attrs[i], &attrcode, &err) != DW_DLV_OK) {
                     derror("error in dwarf_whatattr()");
@@ -322,53 +511,34 @@ add_var_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die child_die)
                 }
 
                 if (attrcode == DW_AT_type) {
-                    ret = dwarf_formref(attrs[i], &offset, &err);
+                    ret = dwarf_global_formref(attrs[i], &offset, &err);
                     if (ret != DW_DLV_OK) {
-                        derror("error in dwarf_formref()");
+                        derror("error in dwarf_global_formref()");
                         goto error;
                     }
 
                     if (get_child_name(dbg, child_die, cname, 64) >= 0) {
                         if (get_parent_name(dbg, parent_die, pname, 64) >= 0) {
-                            sprintf(var->name, "%s.%s", pname, cname);
+                            snprintf(name, sizeof(name), "%s.%s", pname, cname);
+                            var->name = ohm_intern(name);
                             var->function = get_function(pname);
                         } else {
-                            sprintf(var->name, "%s", cname);
+                            var->name = ohm_intern(cname);
                             var->function = NULL;
                         }
                     }
-                    var->type = get_type(offset);
+                    // the type might not have been seen yet, we check
+                    // that it got defined in resolve_variables.
+                    var->type = get_or_add_type(offset);
                 }
             }
-            // skip variables whose types we cannot figure out.
-            if (var->type) {
-                vars_table_size++;
-                // now we know the type. if it is a struct, hoist the
-                // members up as variables
-                basetype_t *type = get_type_alias(var->type);
-                if (is_struct(type->ohm_type)) {
-                    size = 0;
-                    for (i = 0; i < get_type_nelem(type); ++i) {
-                        variable_t *newvar = &vars_table[vars_table_size];
-                        sprintf(newvar->name, "%s.%s", var->name, type->elems[i]->name);
-                        newvar->type = type->elems[i];
-                        newvar->function = var->function;
-                        newvar->loctype = var->loctype;
-                        if (is_addr(var->loctype)) {
-                            newvar->addr = var->addr + size;
-                        } else {
-                            newvar->offset = var->offset + size;
-                        }
-                        size += type->elems[i]->size;
-                        vars_table_size++;
-                    }
-                }
-
-            }
+            if (var->type && !add_variable(var))
+                goto error;
             break;
         case DW_TAG_subprogram:
             saw_lopc = 0;
             saw_hipc = 0;
+            saw_ranges = 0;
             for (i = 0; i < attrcount; ++i) {
                 if (dwarf_whatattr(attrs[i], &attrcode, &err) != DW_DLV_OK) {
                     derror("error in dwarf_whatattr()");
@@ -383,13 +553,15 @@ add_var_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die child_die)
                 if (attrcode == DW_AT_low_pc) {
                     saw_lopc = 1;
                     dwarf_formaddr(attrs[i], &lowpc, &err);
-                    if (saw_hipc)
+                    if (saw_hipc && hipc_is_offset)
                         highpc += lowpc;
                 }
 
                 if (attrcode == DW_AT_high_pc) {
-                    // If Dwarf4
-                    if (form != DW_FORM_addr && form == DW_FORM_data8) {
+                    // Since DWARF4, a high_pc of a constant class is
+                    // an offset from the low_pc.
+                    hipc_is_offset = (form != DW_FORM_addr);
+                    if (hipc_is_offset) {
                         get_number(attrs[i], &bsz);
                         highpc = bsz;
                         if (saw_lopc)
@@ -400,18 +572,40 @@ add_var_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die child_die)
                     saw_hipc = 1;
                 }
 
+                if (attrcode == DW_AT_ranges) {
+                    get_number(attrs[i], &rngoff);
+                    saw_ranges = 1;
+                }
+
+                // the frame base is an expression, but not one that
+                // gives an address that is fixed.
+                if ((attrcode == DW_AT_frame_base) &&
+                    (compile_loclist(dbg, child_die, attrs[i], &frame_base, &fbaddr) != 0))
+                    frame_base = NULL;
+
                 if (saw_lopc && saw_hipc) {
                     /* We construct a table of functions here so that
                      * we can index it later to find the stack probes
                      * to activate. */
-                    get_child_name(dbg, child_die, fns_table[fns_table_size].name, 128);
-                    fns_table[fns_table_size].lowpc = lowpc;
-                    fns_table[fns_table_size].hipc = highpc;
-                    fns_table_size++;
+                    if (get_child_name(dbg, child_die, name, sizeof(name)) < 0)
+                        name[0] = 0;
+                    f = add_function(ohm_intern(name), lowpc, highpc);
+                    if (!f || (add_function_range(f, lowpc, highpc) < 0))
+                        return -1;
                     saw_lopc = 0;
                     saw_hipc = 0;
+                    saw_ranges = 0;
                 }
             }
+
+            if (f)
+                f->frame_base = frame_base;
+
+            // non-contiguous functions (e.g. with hot/cold parts) are
+            // described by a range list instead.
+            if (saw_ranges &&
+                _add_function_ranges(dbg, child_die, rngoff, frame_base) < 0)
+                return -1;
             break;
         default:
             break;
@@ -420,6 +614,158 @@ add_var_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die child_die)
     return 1;
 
 error:
-    derror("error adding variable %s", vars_table[vars_table_size].name);
+    derror("error adding variable %s", var->name);
     return -1;
 }
+
+// finish up the variables of an object once all of its types have
+// been resolved.
+void
+resolve_variables(void)
+{
+    int i, j, n;
+    size_t size;
+    char name[256];
+    variable_t *var, newvar;
+    basetype_t *type;
+
+    // skip variables whose types we cannot figure out.
+    for (i = n = vars_resolved; i < vars_table_size; i++) {
+        if (!vars_table[i]->type || !vars_table[i]->type->ohm_type)
+            continue;
+        vars_table[n++] = vars_table[i];
+    }
+    vars_table_size = n;
+
+    // now we know the types. if it is a struct, hoist the members up
+    // as variables
+    for (i = vars_resolved; i < n; i++) {
+        var = vars_table[i];
+        type = get_type_alias(var->type);
+        if (!is_struct(type->ohm_type))
+            continue;
+
+        size = 0;
+        for (j = 0; j < get_type_nelem(type); ++j) {
+            memset(&newvar, 0, sizeof(newvar));
+            snprintf(name, sizeof(name), "%s.%s", var->name, type->elems[j]->name);
+            newvar.name = ohm_intern(name);
+            newvar.type = type->elems[j];
+            newvar.function = var->function;
+            newvar.loctype = var->loctype;
+            if (is_addr(var->loctype)) {
+                newvar.addr = var->addr + size;
+            } else {
+                newvar.loc = var->loc;
+                newvar.offset = var->offset + size;
+            }
+            size += type->elems[j]->size;
+            if (!add_variable(&newvar))
+                return;
+        }
+    }
+
+    index_variables();
+}
+
+// index the variables by their (qualified) names.
+void
+index_variables(void)
+{
+    int i;
+
+    _name_index_clear(&vars_index);
+    for (i = 0; i < vars_table_size; i++)
+        _name_index_add(&vars_index, i);
+    vars_resolved = vars_table_size;
+}
+
+// remember the current sizes of the symbol tables.
+void
+mark_symbols(symbols_mark_t *m)
+{
+    m->vars = vars_table_size;
+    m->fns = fns_table_size;
+    m->ranges = fns_ranges_size;
+}
+
+// move the global variables and functions added since the mark "m" by
+// the load bias of the object they belong to. The function ranges
+// have to be sorted again with resolve_functions afterwards.
+void
+relocate_symbols(symbols_mark_t *m, addr_t bias)
+{
+    unsigned int i;
+
+    for (i = m->vars; i < vars_table_size; i++) {
+        if (is_addr(vars_table[i]->loctype))
+            vars_table[i]->addr += bias;
+        else
+            relocate_loclist(vars_table[i]->loc, bias);
+    }
+
+    for (i = m->fns; i < fns_table_size; i++) {
+        fns_table[i]->lowpc += bias;
+        fns_table[i]->hipc += bias;
+        relocate_loclist(fns_table[i]->frame_base, bias);
+    }
+
+    for (i = m->ranges; i < fns_ranges_size; i++) {
+        fns_ranges[i].lowpc += bias;
+        fns_ranges[i].hipc += bias;
+    }
+}
+
+// hand the variables and functions tables of this thread over to "s".
+void
+export_funcvars(symbols_t *s)
+{
+    s->vars = vars_table;
+    s->nvars = vars_table_size;
+    s->fns = fns_table;
+    s->nfns = fns_table_size;
+    s->ranges = fns_ranges;
+    s->nranges = fns_ranges_size;
+
+    vars_table = NULL;
+    vars_table_size = vars_table_cap = 0;
+    fns_table = NULL;
+    fns_table_size = fns_table_cap = 0;
+    fns_ranges = NULL;
+    fns_ranges_size = fns_ranges_cap = 0;
+    _name_index_clear(&vars_index);
+    _name_index_clear(&fns_index);
+}
+
+// merge the variables and functions found by another thread. This has
+// to be done after the types are merged so that the variables point
+// to the merged types.
+int
+merge_funcvars(symbols_t *s)
+{
+    unsigned int i;
+    variable_t *var;
+
+    for (i = 0; i < s->nfns; i++)
+        if (_fns_table_push(s->fns[i]) < 0)
+            return -1;
+
+    for (i = 0; i < s->nranges; i++)
+        if (add_function_range(s->ranges[i].fn, s->ranges[i].lowpc,
+                               s->ranges[i].hipc) < 0)
+            return -1;
+
+    for (i = 0; i < s->nvars; i++) {
+        var = s->vars[i];
+        if (var->type)
+            var->type = get_type(var->type->id);
+        if (_vars_table_push(var) < 0)
+            return -1;
+    }
+
+    free(s->vars);
+    free(s->fns);
+    free(s->ranges);
+    memset(s, 0, sizeof(*s));
+    return 0;
+}
@@ -0,0 +1,319 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ohmd.h"
+
+// Lazy symbol loading. A recipe usually names a handful of variables,
+// so instead of walking all of the DIEs in a binary we look the
+// requested names up in the accelerated name tables, load their DIEs
+// and then the types they refer to, transitively.
+
+#define OHM_MAX_LAZY_SYMS 256
+
+typedef struct lazy_sym_t lazy_sym_t;
+struct lazy_sym_t
+{
+    char      name[128];  // name of the global symbol to load
+    Dwarf_Off die;        // global offset of its DIE, or 0 if not found
+};
+
+static lazy_sym_t   lazy_syms[OHM_MAX_LAZY_SYMS];
+static unsigned int lazy_syms_size;
+static unsigned int lazy_syms_found;
+
+// add a symbol to the set of symbols to load. Local variables are
+// named "function.variable" and struct members "variable.member", so
+// we only need to find the DIE of the outermost name.
+static void
+_lazy_add_sym(const char *name)
+{
+    unsigned int i;
+    size_t len = strcspn(name, ".");
+
+    if (!len || (len >= sizeof(lazy_syms[0].name)))
+        return;
+
+    for (i = 0; i < lazy_syms_size; i++)
+        if (!strncmp(lazy_syms[i].name, name, len) && !lazy_syms[i].name[len])
+            return;
+
+    if (lazy_syms_size == OHM_MAX_LAZY_SYMS)
+        return;
+    memcpy(lazy_syms[lazy_syms_size].name, name, len);
+    lazy_syms[lazy_syms_size].name[len] = 0;
+    lazy_syms[lazy_syms_size].die = 0;
+    lazy_syms_size++;
+}
+
+static lazy_sym_t *
+_lazy_find_sym(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < lazy_syms_size; i++)
+        if (!lazy_syms[i].die && !strcmp(lazy_syms[i].name, name))
+            return &lazy_syms[i];
+    return NULL;
+}
+
+// look the symbols up in .debug_pubnames (or .debug_names, with
+// libdwarf versions that read it through the same interface).
+static void
+_lookup_globals(Dwarf_Debug dbg)
+{
+    Dwarf_Error err;
+    Dwarf_Global *globs;
+    Dwarf_Signed nglobs, i;
+    Dwarf_Off die, cu;
+    lazy_sym_t *s;
+    char *name;
+
+    if (dwarf_get_globals(dbg, &globs, &nglobs, &err) != DW_DLV_OK)
+        return;
+
+    for (i = 0; (i < nglobs) && (lazy_syms_found < lazy_syms_size); i++) {
+        if (dwarf_global_name_offsets(globs[i], &name, &die, &cu, &err) != DW_DLV_OK)
+            continue;
+        if ((s = _lazy_find_sym(name)) != NULL) {
+            s->die = die;
+            lazy_syms_found++;
+        }
+        dwarf_dealloc(dbg, name, DW_DLA_STRING);
+    }
+    dwarf_globals_dealloc(dbg, globs, nglobs);
+}
+
+// find the defining DIE of a global variable or function in the
+// compile unit whose header is at @p cu_hdr.
+static Dwarf_Off
+_find_in_cu(Dwarf_Debug dbg, Dwarf_Off cu_hdr, const char *name)
+{
+    Dwarf_Error err;
+    Dwarf_Off cu_off, off = 0;
+    Dwarf_Die cu_die, die, sib;
+    Dwarf_Half tag;
+    Dwarf_Bool decl;
+    char cname[128];
+    int ret;
+
+    if (dwarf_get_cu_die_offset_given_cu_header_offset(dbg, cu_hdr, &cu_off,
+                                                       &err) != DW_DLV_OK)
+        return 0;
+    if (dwarf_offdie(dbg, cu_off, &cu_die, &err) != DW_DLV_OK)
+        return 0;
+
+    ret = dwarf_child(cu_die, &die, &err);
+    while (ret == DW_DLV_OK) {
+        if ((dwarf_tag(die, &tag, &err) == DW_DLV_OK) &&
+            ((tag == DW_TAG_variable) || (tag == DW_TAG_subprogram)) &&
+            (dwarf_hasattr(die, DW_AT_declaration, &decl, &err) == DW_DLV_OK) &&
+            !decl && (get_child_name(dbg, die, cname, sizeof(cname)) >= 0) &&
+            !strcmp(cname, name)) {
+            dwarf_dieoffset(die, &off, &err);
+            dwarf_dealloc(dbg, die, DW_DLA_DIE);
+            break;
+        }
+
+        ret = dwarf_siblingof(dbg, die, &sib, &err);
+        dwarf_dealloc(dbg, die, DW_DLA_DIE);
+        die = sib;
+    }
+    dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+    return off;
+}
+
+// look the remaining symbols up in .gdb_index. It only tells us which
+// compile units define a name, so we search those for its DIE.
+static void
+_lookup_gdb_index(Dwarf_Debug dbg)
+{
+    Dwarf_Error err;
+    Dwarf_Gdbindex gdbindex;
+    Dwarf_Unsigned version, cu_list, types_list, addr_area, symtab, pool;
+    Dwarf_Unsigned size, reserved, nsyms, i, j, stroff, cuvec, ncus;
+    Dwarf_Unsigned attr, cu_index, kind, is_static, cu_hdr, cu_len;
+    const char *secname, *name;
+    lazy_sym_t *s;
+
+    if (dwarf_gdbindex_header(dbg, &gdbindex, &version, &cu_list, &types_list,
+                              &addr_area, &symtab, &pool, &size, &reserved,
+                              &secname, &err) != DW_DLV_OK)
+        return;
+
+    if (dwarf_gdbindex_symboltable_array(gdbindex, &nsyms, &err) != DW_DLV_OK)
+        goto out;
+
+    for (i = 0; (i < nsyms) && (lazy_syms_found < lazy_syms_size); i++) {
+        if (dwarf_gdbindex_symboltable_entry(gdbindex, i, &stroff, &cuvec,
+                                             &err) != DW_DLV_OK)
+            continue;
+        // empty slots of the hash table have no name or CU vector
+        if (!stroff && !cuvec)
+            continue;
+        if (dwarf_gdbindex_string_by_offset(gdbindex, stroff, &name,
+                                            &err) != DW_DLV_OK)
+            continue;
+        if ((s = _lazy_find_sym(name)) == NULL)
+            continue;
+
+        if (dwarf_gdbindex_cuvector_length(gdbindex, cuvec, &ncus,
+                                           &err) != DW_DLV_OK)
+            continue;
+        for (j = 0; (j < ncus) && !s->die; j++) {
+            if ((dwarf_gdbindex_cuvector_inner_attributes(gdbindex, cuvec, j,
+                                                          &attr, &err) != DW_DLV_OK) ||
+                (dwarf_gdbindex_cuvector_instance_expand_value(gdbindex, attr,
+                                                               &cu_index, &reserved,
+                                                               &kind, &is_static,
+                                                               &err) != DW_DLV_OK) ||
+                (dwarf_gdbindex_culist_entry(gdbindex, cu_index, &cu_hdr,
+                                             &cu_len, &err) != DW_DLV_OK))
+                continue;
+            s->die = _find_in_cu(dbg, cu_hdr, s->name);
+        }
+        if (s->die)
+            lazy_syms_found++;
+    }
+
+out:
+    dwarf_gdbindex_free(gdbindex);
+}
+
+// check if the die at "off" is in a skeleton unit, whose DIEs are in a
+// .dwo file instead.
+static bool
+_in_skeleton_unit(Dwarf_Debug dbg, debuginfo_t *di, Dwarf_Off off)
+{
+    Dwarf_Error err;
+    Dwarf_Off cu_off;
+    Dwarf_Die die, cu_die;
+    char dwo[PATH_MAX];
+    bool skel = false;
+
+    if (dwarf_offdie(dbg, off, &die, &err) != DW_DLV_OK)
+        return false;
+    if ((dwarf_CU_dieoffset_given_die(die, &cu_off, &err) == DW_DLV_OK) &&
+        (dwarf_offdie(dbg, cu_off, &cu_die, &err) == DW_DLV_OK)) {
+        skel = (get_dwo_path(cu_die, di, dwo, sizeof(dwo)) == 0);
+        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+    }
+    dwarf_dealloc(dbg, die, DW_DLA_DIE);
+    return skel;
+}
+
+// invoke the callback on a die and all of its descendants.
+static void
+_load_die(dwarf_query_cb_t cb, Dwarf_Debug dbg, Dwarf_Die parent_die,
+          Dwarf_Die die)
+{
+    Dwarf_Error err;
+    Dwarf_Die child;
+
+    (*cb)(dbg, parent_die, die);
+    if (dwarf_child(die, &child, &err) == DW_DLV_OK) {
+        traverse_die(cb, dbg, die, child);
+        dwarf_dealloc(dbg, child, DW_DLA_DIE);
+    }
+}
+
+static int
+_load_die_at(dwarf_query_cb_t cb, Dwarf_Debug dbg, Dwarf_Off off, bool toplevel)
+{
+    Dwarf_Error err;
+    Dwarf_Off cu_off;
+    Dwarf_Die die, cu_die = NULL;
+
+    if (dwarf_offdie(dbg, off, &die, &err) != DW_DLV_OK) {
+        derror("error in dwarf_offdie(0x%llx)", (unsigned long long)off);
+        return -1;
+    }
+
+    // global variables and functions are children of their compile
+    // unit.
+    if (toplevel && (dwarf_CU_dieoffset_given_die(die, &cu_off, &err) == DW_DLV_OK))
+        dwarf_offdie(dbg, cu_off, &cu_die, &err);
+
+    _load_die(cb, dbg, cu_die, die);
+    if (cu_die)
+        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+    dwarf_dealloc(dbg, die, DW_DLA_DIE);
+    return 0;
+}
+
+// scan only the symbols named by the probes in @p names from a file,
+// along with the types they need. Returns 0 if not all of them could
+// be found through the accelerated name tables; the tables are left
+// untouched in that case so that the caller can fall back to a full
+// scan.
+int
+scan_file_lazy(char *file, char **names, int n, dwarf_query_cb_t cb)
+{
+    int i, ret = -1;
+    Dwarf_Debug dbg;
+    debuginfo_t di;
+    dwarf_file_t f;
+    basetype_t *t;
+
+    lazy_syms_size = 0;
+    lazy_syms_found = 0;
+    // we always need main to know where to stop unwinding.
+    _lazy_add_sym("main");
+    for (i = 0; i < n; i++)
+        _lazy_add_sym(names[i]);
+
+    // the name tables of split units do not point at their DIEs.
+    if (find_debuginfo(file, &di) < 0)
+        return 0;
+    if (di.dwp[0])
+        return 0;
+    if (dwarf_file_open(&di, &f) < 0)
+        return -1;
+    dbg = f.dbg;
+
+    _lookup_globals(dbg);
+    if (lazy_syms_found < lazy_syms_size)
+        _lookup_gdb_index(dbg);
+
+    if (lazy_syms_found < lazy_syms_size) {
+        for (i = 0; i < lazy_syms_size; i++)
+            if (!lazy_syms[i].die)
+                ddebug("symbol %s is not in the name index.", lazy_syms[i].name);
+        ret = 0;
+        goto out;
+    }
+
+    for (i = 0; i < lazy_syms_size; i++) {
+        if (_in_skeleton_unit(dbg, &di, lazy_syms[i].die)) {
+            ret = 0;
+            goto out;
+        }
+    }
+
+    for (i = 0; i < lazy_syms_size; i++)
+        if (_load_die_at(cb, dbg, lazy_syms[i].die, true) < 0)
+            goto out;
+
+    // load the types the symbols refer to. The table grows as we go,
+    // so this walks the type graph until every reachable type has
+    // been visited once.
+    for (i = 0; i < types_table_size; i++) {
+        t = types_table[i];
+        if (!t->ohm_type && (_load_die_at(cb, dbg, t->id, false) < 0))
+            goto out;
+    }
+    ret = 1;
+
+out:
+    dwarf_file_close(&f);
+    return ret;
+}
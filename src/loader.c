@@ -0,0 +1,235 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "ohmd.h"
+
+// Parallel symbol loading. The compile units of a binary are split
+// into contiguous blocks of about the same size in .debug_info, and
+// each block is loaded by a worker thread with its own libdwarf handle
+// into its own (thread-local) symbol tables. The tables are merged in
+// the order of the blocks, so the result is the same as that of a
+// sequential scan.
+
+#define OHM_MAX_LOADERS 64
+
+typedef struct loader_t loader_t;
+struct loader_t
+{
+    pthread_t         thread;
+    debuginfo_t      *di;
+    dwarf_query_cb_t  cb;
+    Dwarf_Off         id_base; // types_id_base of the object
+    unsigned int      first;  // first compile unit to load
+    unsigned int      last;   // one past the last compile unit to load
+    int               ret;
+    symbols_t         syms;   // the symbols loaded by this worker
+};
+
+// get the offsets of the ends of all compile units in .debug_info.
+static int
+_get_cu_offsets(debuginfo_t *di, Dwarf_Unsigned **offsets, unsigned int *ncu)
+{
+    int ret;
+    unsigned int cap = 0;
+    dwarf_file_t f;
+    Dwarf_Error err;
+    Dwarf_Unsigned cu_hdr_len, abbr_off, next_cu_hdr, *v;
+    Dwarf_Half ver_stamp, addr_sz;
+
+    *offsets = NULL;
+    *ncu = 0;
+
+    if (dwarf_file_open(di, &f) < 0)
+        return -1;
+
+    while (1) {
+        ret = dwarf_next_cu_header(f.dbg, &cu_hdr_len, &ver_stamp, &abbr_off,
+                                   &addr_sz, &next_cu_hdr, &err);
+        if (ret == DW_DLV_ERROR) {
+            derror("error reading DWARF CU header.");
+            goto error;
+        } else if (ret == DW_DLV_NO_ENTRY)
+            break;
+
+        if (*ncu == cap) {
+            v = ohm_grow(*offsets, &cap, sizeof(*v));
+            if (!v)
+                goto error;
+            *offsets = v;
+        }
+        (*offsets)[(*ncu)++] = next_cu_hdr;
+    }
+
+    dwarf_file_close(&f);
+    return 0;
+
+error:
+    dwarf_file_close(&f);
+    free(*offsets);
+    *offsets = NULL;
+    return -1;
+}
+
+static void *
+_loader_main(void *arg)
+{
+    loader_t *l = arg;
+    int ret;
+    unsigned int cu;
+    dwarf_file_t f;
+    Dwarf_Error err;
+    Dwarf_Unsigned cu_hdr_len, abbr_off, next_cu_hdr;
+    Dwarf_Half ver_stamp, addr_sz;
+    Dwarf_Die cu_die;
+
+    l->ret = -1;
+    types_id_base = l->id_base;
+    if (dwarf_file_open(l->di, &f) < 0)
+        goto export;
+
+    // the headers are cheap to skip over, the DIEs are what we split.
+    for (cu = 0; cu < l->last; cu++) {
+        ret = dwarf_next_cu_header(f.dbg, &cu_hdr_len, &ver_stamp, &abbr_off,
+                                   &addr_sz, &next_cu_hdr, &err);
+        if (ret == DW_DLV_ERROR) {
+            derror("error reading DWARF CU header.");
+            goto out;
+        } else if (ret == DW_DLV_NO_ENTRY)
+            break;
+
+        if (cu < l->first)
+            continue;
+
+        if (dwarf_siblingof(f.dbg, NULL, &cu_die, &err) == DW_DLV_ERROR) {
+            derror("error getting sibling of cu.");
+            continue;
+        }
+
+        scan_cu(l->cb, l->di, f.dbg, cu_die, cu);
+        dwarf_dealloc(f.dbg, cu_die, DW_DLA_DIE);
+    }
+    l->ret = 0;
+
+out:
+    dwarf_file_close(&f);
+export:
+    export_types(&l->syms);
+    export_funcvars(&l->syms);
+    return NULL;
+}
+
+// free the tables of a worker that were not merged.
+static void
+_free_symbols(symbols_t *s)
+{
+    free(s->types);
+    free(s->fns);
+    free(s->ranges);
+    free(s->vars);
+    memset(s, 0, sizeof(*s));
+}
+
+// scan the symbols of a file with "nthreads" worker threads. Returns 0
+// if the file is not worth splitting or if a worker failed, in which
+// case nothing has been loaded and the file has to be scanned
+// sequentially.
+int
+scan_file_parallel(char *file, int nthreads, dwarf_query_cb_t cb)
+{
+    int i, n, ret = -1;
+    unsigned int ncu, cu;
+    Dwarf_Unsigned *offsets, size;
+    loader_t *loaders;
+    debuginfo_t di;
+
+    if (find_debuginfo(file, &di) < 0) {
+        derror("no debug information found for %s.", file);
+        return -1;
+    }
+
+    if (_get_cu_offsets(&di, &offsets, &ncu) < 0)
+        return -1;
+
+    n = nthreads;
+    if (n > OHM_MAX_LOADERS)
+        n = OHM_MAX_LOADERS;
+    if (n > ncu)
+        n = ncu;
+    if (n < 2) {
+        free(offsets);
+        return 0;
+    }
+
+    loaders = calloc(n, sizeof(*loaders));
+    if (!loaders) {
+        derror("unable to allocate memory.");
+        free(offsets);
+        return -1;
+    }
+
+    // split the compile units into blocks of about the same size.
+    size = offsets[ncu-1];
+    for (i = 0, cu = 0; i < n; i++) {
+        loaders[i].di = &di;
+        loaders[i].cb = cb;
+        loaders[i].id_base = types_id_base;
+        loaders[i].first = cu;
+        while ((cu < ncu) && (offsets[cu] <= (size * (i + 1)) / n))
+            cu++;
+        loaders[i].last = (i == n - 1) ? ncu : cu;
+    }
+    free(offsets);
+
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&loaders[i].thread, NULL, _loader_main,
+                           &loaders[i]) != 0) {
+            derror("unable to create loader thread.");
+            break;
+        }
+    }
+    for (cu = 0; cu < i; cu++)
+        pthread_join(loaders[cu].thread, NULL);
+
+    // fall back to a sequential scan if we could not start them all,
+    // or if any of them failed.
+    if (i < n) {
+        ret = 0;
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (loaders[i].ret < 0) {
+            ddebug("loader thread failed, loading sequentially.");
+            ret = 0;
+            goto out;
+        }
+    }
+
+    // the types have to be in place before the variables that refer
+    // to them are merged.
+    for (i = 0; i < n; i++)
+        if (merge_types(&loaders[i].syms) < 0)
+            goto out;
+    for (i = 0; i < n; i++)
+        if (merge_funcvars(&loaders[i].syms) < 0)
+            goto out;
+    relink_types();
+    ddebug("loaded %u compile units with %d threads.", ncu, n);
+    ret = 1;
+
+out:
+    for (i = 0; i < n; i++)
+        _free_symbols(&loaders[i].syms);
+    free(loaders);
+    return ret;
+}
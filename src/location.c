@@ -0,0 +1,670 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ohmd.h"
+
+// Location programs. The DWARF location expressions of the variables
+// of optimized code are mostly lists of expressions, each valid for a
+// range of PCs, that put the variable in a register for a while and on
+// the stack later, or split it into pieces. Evaluating them with
+// libdwarf on every sample is too slow, so we compile them at load
+// time into a simple bytecode with its operands decoded, and run that
+// against the registers of the unwound frame instead.
+
+#ifndef DW_OP_entry_value
+#define DW_OP_entry_value       0xa3
+#endif
+
+#ifndef DW_OP_GNU_entry_value
+#define DW_OP_GNU_entry_value   0xf3
+#endif
+
+#ifndef DW_OP_form_tls_address
+#define DW_OP_form_tls_address  0x9b
+#endif
+
+enum
+{
+    LOC_OP_UNAVAILABLE,      // the piece is optimized out
+    LOC_OP_CONST,            // push arg
+    LOC_OP_ADDR,             // push arg, relocated
+    LOC_OP_REG,              // the value is in register reg
+    LOC_OP_ENTRY_REG,        // push the value of register reg on entry
+    LOC_OP_BREG,             // push register reg + arg
+    LOC_OP_FBREG,            // push the frame base + arg
+    LOC_OP_CFA,              // push the canonical frame address
+    LOC_OP_TLS,              // pop an offset, push its address in the TLS block
+    LOC_OP_DEREF,            // pop an address, push the arg bytes there
+    LOC_OP_DUP,
+    LOC_OP_DROP,
+    LOC_OP_OVER,
+    LOC_OP_PICK,             // push the arg'th entry
+    LOC_OP_SWAP,
+    LOC_OP_ROT,
+    LOC_OP_ABS,
+    LOC_OP_AND,
+    LOC_OP_DIV,
+    LOC_OP_MINUS,
+    LOC_OP_MOD,
+    LOC_OP_MUL,
+    LOC_OP_NEG,
+    LOC_OP_NOT,
+    LOC_OP_OR,
+    LOC_OP_PLUS,
+    LOC_OP_PLUS_UCONST,      // add arg to the top
+    LOC_OP_SHL,
+    LOC_OP_SHR,
+    LOC_OP_SHRA,
+    LOC_OP_XOR,
+    LOC_OP_EQ,
+    LOC_OP_GE,
+    LOC_OP_GT,
+    LOC_OP_LE,
+    LOC_OP_LT,
+    LOC_OP_NE,
+    LOC_OP_SKIP,             // go to op number arg
+    LOC_OP_BRA,              // pop, and go to op number arg if it is not 0
+    LOC_OP_STACK_VALUE,      // the top is the value, not its address
+    LOC_OP_IMPLICIT,         // the value is arg
+    LOC_OP_PIECE,            // the arg bytes described so far are a piece
+};
+
+#define OHM_LOC_STACK_SIZE  64
+
+// the location programs outlive the compile units they come from
+static OHM_TLS ohm_arena_t locs_arena;
+
+loclist_t *
+new_loclist(unsigned int nranges)
+{
+    loclist_t *loc;
+
+    loc = ohm_alloc(&locs_arena, sizeof(*loc) + nranges * sizeof(loc->ranges[0]));
+    if (loc)
+        loc->nranges = nranges;
+    return loc;
+}
+
+loc_op_t *
+new_loc_ops(unsigned int nops)
+{
+    return ohm_alloc(&locs_arena, (nops ? nops : 1) * sizeof(loc_op_t));
+}
+
+// the location programs are relocated when they are run, so that the
+// struct members hoisted out of a variable can share its program.
+void
+relocate_loclist(loclist_t *loc, addr_t bias)
+{
+    if (loc)
+        loc->bias = bias;
+}
+
+// find the op of a program at the byte offset "off" of its expression
+static int
+_find_op(Dwarf_Locdesc *ld, Dwarf_Unsigned off)
+{
+    int k;
+
+    for (k = 0; k < ld->ld_cents; k++)
+        if (ld->ld_s[k].lr_offset == off)
+            return k;
+    // a branch past the last op ends the program
+    return (ld->ld_cents && off > ld->ld_s[ld->ld_cents-1].lr_offset)
+        ? ld->ld_cents : -1;
+}
+
+// get the register of an entry value expression made of only a
+// DW_OP_regN or DW_OP_regx.
+static int
+_entry_reg(Dwarf_Unsigned len, unsigned char *expr, unsigned short *reg)
+{
+    Dwarf_Unsigned i, n;
+    int shift;
+
+    if (!len || !expr)
+        return -1;
+    if (expr[0] >= DW_OP_reg0 && expr[0] <= DW_OP_reg31) {
+        *reg = expr[0] - DW_OP_reg0;
+        return (len == 1) ? 0 : -1;
+    }
+    if (expr[0] != DW_OP_regx)
+        return -1;
+
+    // the register number is an unsigned LEB128
+    for (i = 1, n = 0, shift = 0; i < len && shift < 16; i++, shift += 7) {
+        n |= (Dwarf_Unsigned)(expr[i] & 0x7f) << shift;
+        if (!(expr[i] & 0x80))
+            break;
+    }
+    if (i != len - 1 || n > USHRT_MAX)
+        return -1;
+    *reg = n;
+    return 0;
+}
+
+// compile a single DWARF expression
+static int
+_compile_expr(Dwarf_Locdesc *ld, loc_range_t *r)
+{
+    Dwarf_Loc *expr;
+    Dwarf_Small atom;
+    loc_op_t *op;
+    int k, target;
+
+    r->nops = ld->ld_cents;
+    r->ops = new_loc_ops(r->nops);
+    if (!r->ops)
+        return -1;
+
+    for (k = 0; k < ld->ld_cents; k++) {
+        expr = &ld->ld_s[k];
+        atom = expr->lr_atom;
+        op = &r->ops[k];
+        op->arg = expr->lr_number;
+
+        if (atom >= DW_OP_lit0 && atom <= DW_OP_lit31) {
+            op->op = LOC_OP_CONST;
+            op->arg = atom - DW_OP_lit0;
+            continue;
+        } else if (atom >= DW_OP_reg0 && atom <= DW_OP_reg31) {
+            op->op = LOC_OP_REG;
+            op->reg = atom - DW_OP_reg0;
+            continue;
+        } else if (atom >= DW_OP_breg0 && atom <= DW_OP_breg31) {
+            op->op = LOC_OP_BREG;
+            op->reg = atom - DW_OP_breg0;
+            continue;
+        }
+
+        switch (atom) {
+            case DW_OP_addr:
+                op->op = LOC_OP_ADDR;
+                break;
+            case DW_OP_const1u:
+            case DW_OP_const2u:
+            case DW_OP_const4u:
+            case DW_OP_const8u:
+            case DW_OP_constu:
+            case DW_OP_const1s:
+            case DW_OP_const2s:
+            case DW_OP_const4s:
+            case DW_OP_const8s:
+            case DW_OP_consts:
+                op->op = LOC_OP_CONST;
+                break;
+            case DW_OP_regx:
+                op->op = LOC_OP_REG;
+                op->reg = expr->lr_number;
+                break;
+            case DW_OP_bregx:
+                op->op = LOC_OP_BREG;
+                op->reg = expr->lr_number;
+                op->arg = expr->lr_number2;
+                break;
+            case DW_OP_fbreg:
+                op->op = LOC_OP_FBREG;
+                break;
+            case DW_OP_call_frame_cfa:
+                op->op = LOC_OP_CFA;
+                break;
+            case DW_OP_GNU_push_tls_address:
+            case DW_OP_form_tls_address:
+                // we only know where the TLS block of the executable
+                // is, the others are allocated by the dynamic linker.
+                op->op = (types_id_base >> 48) ? LOC_OP_UNAVAILABLE : LOC_OP_TLS;
+                break;
+            case DW_OP_deref:
+                op->op = LOC_OP_DEREF;
+                op->arg = sizeof(addr_t);
+                break;
+            case DW_OP_deref_size:
+                op->op = LOC_OP_DEREF;
+                if (op->arg > sizeof(addr_t))
+                    op->op = LOC_OP_UNAVAILABLE;
+                break;
+            case DW_OP_dup:         op->op = LOC_OP_DUP; break;
+            case DW_OP_drop:        op->op = LOC_OP_DROP; break;
+            case DW_OP_over:        op->op = LOC_OP_OVER; break;
+            case DW_OP_pick:        op->op = LOC_OP_PICK; break;
+            case DW_OP_swap:        op->op = LOC_OP_SWAP; break;
+            case DW_OP_rot:         op->op = LOC_OP_ROT; break;
+            case DW_OP_abs:         op->op = LOC_OP_ABS; break;
+            case DW_OP_and:         op->op = LOC_OP_AND; break;
+            case DW_OP_div:         op->op = LOC_OP_DIV; break;
+            case DW_OP_minus:       op->op = LOC_OP_MINUS; break;
+            case DW_OP_mod:         op->op = LOC_OP_MOD; break;
+            case DW_OP_mul:         op->op = LOC_OP_MUL; break;
+            case DW_OP_neg:         op->op = LOC_OP_NEG; break;
+            case DW_OP_not:         op->op = LOC_OP_NOT; break;
+            case DW_OP_or:          op->op = LOC_OP_OR; break;
+            case DW_OP_plus:        op->op = LOC_OP_PLUS; break;
+            case DW_OP_plus_uconst: op->op = LOC_OP_PLUS_UCONST; break;
+            case DW_OP_shl:         op->op = LOC_OP_SHL; break;
+            case DW_OP_shr:         op->op = LOC_OP_SHR; break;
+            case DW_OP_shra:        op->op = LOC_OP_SHRA; break;
+            case DW_OP_xor:         op->op = LOC_OP_XOR; break;
+            case DW_OP_eq:          op->op = LOC_OP_EQ; break;
+            case DW_OP_ge:          op->op = LOC_OP_GE; break;
+            case DW_OP_gt:          op->op = LOC_OP_GT; break;
+            case DW_OP_le:          op->op = LOC_OP_LE; break;
+            case DW_OP_lt:          op->op = LOC_OP_LT; break;
+            case DW_OP_ne:          op->op = LOC_OP_NE; break;
+            case DW_OP_skip:
+            case DW_OP_bra:
+                // the targets are byte offsets into the expression,
+                // we turn them into op numbers.
+                target = _find_op(ld, expr->lr_offset + 3 + (short)expr->lr_number);
+                op->op = (atom == DW_OP_skip) ? LOC_OP_SKIP : LOC_OP_BRA;
+                op->arg = target;
+                if (target < 0)
+                    op->op = LOC_OP_UNAVAILABLE;
+                break;
+            case DW_OP_stack_value:
+                op->op = LOC_OP_STACK_VALUE;
+                break;
+            case DW_OP_implicit_value:
+                // the operands are the length of the value and a
+                // pointer to its bytes.
+                op->op = LOC_OP_UNAVAILABLE;
+                if (expr->lr_number <= sizeof(addr_t) && expr->lr_number2) {
+                    op->op = LOC_OP_IMPLICIT;
+                    op->arg = 0;
+                    memcpy(&op->arg, (void *)(uintptr_t)expr->lr_number2,
+                           expr->lr_number);
+                }
+                break;
+            case DW_OP_piece:
+                op->op = LOC_OP_PIECE;
+                break;
+            case DW_OP_bit_piece:
+                // only whole bytes
+                op->op = LOC_OP_PIECE;
+                op->arg = expr->lr_number >> 3;
+                if ((expr->lr_number & 7) || expr->lr_number2)
+                    op->op = LOC_OP_UNAVAILABLE;
+                break;
+            case DW_OP_nop:
+                op->op = LOC_OP_SKIP;
+                op->arg = k + 1;
+                break;
+            case DW_OP_entry_value:
+            case DW_OP_GNU_entry_value:
+                // the operands are the length of the expression and a
+                // pointer to it. We only know how to get the value a
+                // register had on entry to the function.
+                op->op = LOC_OP_UNAVAILABLE;
+                if (_entry_reg(expr->lr_number,
+                               (unsigned char *)(uintptr_t)expr->lr_number2,
+                               &op->reg) == 0) {
+                    op->op = LOC_OP_ENTRY_REG;
+                    op->arg = 0;
+                }
+                break;
+            default:
+                ddebug("unsupported location OP (0x%x).", atom);
+                op->op = LOC_OP_UNAVAILABLE;
+                break;
+        }
+    }
+    return 0;
+}
+
+int
+compile_locdescs(Dwarf_Locdesc **lds, Dwarf_Signed n, Dwarf_Addr base,
+                 loclist_t **loc, addr_t *addr)
+{
+    Dwarf_Locdesc *ld;
+    Dwarf_Signed i;
+    loc_range_t *r;
+
+    *loc = NULL;
+    if (n <= 0)
+        return -1;
+
+    // the common case of a variable at a fixed address needs no program
+    ld = lds[0];
+    if (n == 1 && !ld->ld_from_loclist && ld->ld_cents == 1 &&
+        ld->ld_s[0].lr_atom == DW_OP_addr) {
+        *addr = ld->ld_s[0].lr_number;
+        return 1;
+    }
+
+    *loc = new_loclist(n);
+    if (!*loc)
+        return -1;
+
+    (*loc)->nranges = 0;
+    for (i = 0; i < n; i++) {
+        ld = lds[i];
+        r = &(*loc)->ranges[(*loc)->nranges];
+        if (!ld->ld_from_loclist) {
+            r->lowpc = OHM_LOC_ANYPC_LOW;
+            r->hipc = OHM_LOC_ANYPC_HIGH;
+        } else if (ld->ld_lopc == OHM_LOC_ANYPC_HIGH) {
+            // a base address selection entry
+            base = ld->ld_hipc;
+            continue;
+        } else {
+            r->lowpc = base + ld->ld_lopc;
+            r->hipc = base + ld->ld_hipc;
+        }
+
+        if (_compile_expr(ld, r) < 0)
+            return -1;
+        (*loc)->nranges++;
+    }
+    return 0;
+}
+
+int
+compile_loclist(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Attribute attr,
+                loclist_t **loc, addr_t *addr)
+{
+    Dwarf_Locdesc **llbufarray = 0;
+    Dwarf_Signed nelem, i;
+    Dwarf_Error err;
+    Dwarf_Addr base = 0;
+    int ret;
+
+    *loc = NULL;
+    ret = dwarf_loclist_n(attr, &llbufarray, &nelem, &err);
+    if (ret == DW_DLV_ERROR) {
+        derror("error in dwarf_loclist_n().");
+        return -1;
+    } else if (ret == DW_DLV_NO_ENTRY || nelem <= 0)
+        return -1;
+
+    ret = -1;
+    for (i = 0; i < nelem; i++)
+        if (resolve_addr_indexes(die, llbufarray[i]) < 0)
+            goto out;
+
+    if (llbufarray[0]->ld_from_loclist &&
+        get_cu_base_address(dbg, die, &base) < 0)
+        goto out;
+
+    ret = compile_locdescs(llbufarray, nelem, base, loc, addr);
+
+out:
+    for (i = 0; i < nelem; i++) {
+        dwarf_dealloc(dbg, llbufarray[i]->ld_s, DW_DLA_LOC_BLOCK);
+        dwarf_dealloc(dbg, llbufarray[i], DW_DLA_LOCDESC);
+    }
+    dwarf_dealloc(dbg, llbufarray, DW_DLA_LIST);
+    return ret;
+}
+
+/**********************************************************************/
+
+// finish a piece of the value
+static int
+_add_piece(loc_value_t *val, int kind, addr_t *stack, int si, size_t size)
+{
+    loc_piece_t *p;
+
+    if (val->npieces == OHM_LOC_MAX_PIECES)
+        return -1;
+
+    p = &val->pieces[val->npieces++];
+    p->kind = (si < 0) ? OHM_LOC_NONE : kind;
+    p->val = (si < 0) ? 0 : stack[si];
+    p->size = size;
+    return 0;
+}
+
+int
+eval_loclist(loclist_t *loc, loc_frame_t *f, loc_value_t *val)
+{
+    addr_t stack[OHM_LOC_STACK_SIZE], pc, a, b;
+    loc_range_t *r = NULL;
+    loc_op_t *op;
+    unsigned int i, steps;
+    int si, kind;
+
+    val->npieces = 0;
+    if (!loc)
+        return -1;
+
+    pc = f->pc - loc->bias;
+    for (i = 0; i < loc->nranges; i++) {
+        r = &loc->ranges[i];
+        if (pc >= r->lowpc && pc < r->hipc)
+            break;
+    }
+    if (i == loc->nranges || !r->nops)
+        return -1;
+
+#define PUSH(v) do { if (si+1 >= OHM_LOC_STACK_SIZE) return -1;   \
+                     a = (v); stack[++si] = a; } while (0)
+#define NEED(n) do { if (si+1 < (n)) return -1; } while (0)
+#define BINOP(expr) do { NEED(2); a = stack[si-1]; b = stack[si];  \
+                         stack[--si] = (expr); } while (0)
+
+    si = -1;
+    kind = OHM_LOC_MEMORY;
+    // bound the number of steps in case of a backward branch
+    for (i = 0, steps = 0; i < r->nops && steps < 1024; i++, steps++) {
+        op = &r->ops[i];
+        switch (op->op) {
+            case LOC_OP_UNAVAILABLE:
+                // skip to the next piece
+                while (i+1 < r->nops && r->ops[i+1].op != LOC_OP_PIECE)
+                    i++;
+                kind = OHM_LOC_NONE;
+                break;
+            case LOC_OP_CONST:
+                PUSH(op->arg);
+                break;
+            case LOC_OP_ADDR:
+                PUSH(op->arg + loc->bias);
+                break;
+            case LOC_OP_REG:
+                a = 0;
+                if (f->get_reg(f, op->reg, &a) < 0)
+                    kind = OHM_LOC_NONE;
+                else
+                    kind = OHM_LOC_VALUE;
+                PUSH(a);
+                break;
+            case LOC_OP_ENTRY_REG:
+                if (!f->get_entry_reg || f->get_entry_reg(f, op->reg, &a) < 0) {
+                    // the piece is unavailable, as above
+                    while (i+1 < r->nops && r->ops[i+1].op != LOC_OP_PIECE)
+                        i++;
+                    kind = OHM_LOC_NONE;
+                    break;
+                }
+                PUSH(a);
+                break;
+            case LOC_OP_BREG:
+                if (f->get_reg(f, op->reg, &a) < 0)
+                    return -1;
+                PUSH(a + op->arg);
+                break;
+            case LOC_OP_FBREG:
+                if (f->get_frame_base(f, &a) < 0)
+                    return -1;
+                PUSH(a + op->arg);
+                break;
+            case LOC_OP_CFA:
+                if (f->get_cfa(f, &a) < 0)
+                    return -1;
+                PUSH(a);
+                break;
+            case LOC_OP_TLS:
+                NEED(1);
+                if (f->get_tls(f, stack[si], &stack[si]) < 0)
+                    return -1;
+                break;
+            case LOC_OP_DEREF:
+                NEED(1);
+                a = 0;
+                if (f->read_mem(f, stack[si], &a, op->arg) < 0)
+                    return -1;
+                stack[si] = a;
+                break;
+            case LOC_OP_DUP:
+                NEED(1);
+                PUSH(stack[si]);
+                break;
+            case LOC_OP_DROP:
+                NEED(1);
+                si--;
+                break;
+            case LOC_OP_OVER:
+                NEED(2);
+                PUSH(stack[si-1]);
+                break;
+            case LOC_OP_PICK:
+                NEED(op->arg + 1);
+                PUSH(stack[si-op->arg]);
+                break;
+            case LOC_OP_SWAP:
+                NEED(2);
+                a = stack[si];
+                stack[si] = stack[si-1];
+                stack[si-1] = a;
+                break;
+            case LOC_OP_ROT:
+                NEED(3);
+                a = stack[si];
+                stack[si] = stack[si-1];
+                stack[si-1] = stack[si-2];
+                stack[si-2] = a;
+                break;
+            case LOC_OP_ABS:
+                NEED(1);
+                if ((long)stack[si] < 0)
+                    stack[si] = -stack[si];
+                break;
+            case LOC_OP_NEG:
+                NEED(1);
+                stack[si] = -stack[si];
+                break;
+            case LOC_OP_NOT:
+                NEED(1);
+                stack[si] = ~stack[si];
+                break;
+            case LOC_OP_PLUS_UCONST:
+                NEED(1);
+                stack[si] += op->arg;
+                break;
+            case LOC_OP_AND:   BINOP(a & b); break;
+            case LOC_OP_MINUS: BINOP(a - b); break;
+            case LOC_OP_MUL:   BINOP(a * b); break;
+            case LOC_OP_OR:    BINOP(a | b); break;
+            case LOC_OP_PLUS:  BINOP(a + b); break;
+            case LOC_OP_SHL:   BINOP(a << b); break;
+            case LOC_OP_SHR:   BINOP(a >> b); break;
+            case LOC_OP_SHRA:  BINOP((long)a >> b); break;
+            case LOC_OP_XOR:   BINOP(a ^ b); break;
+            case LOC_OP_EQ:    BINOP((long)a == (long)b); break;
+            case LOC_OP_GE:    BINOP((long)a >= (long)b); break;
+            case LOC_OP_GT:    BINOP((long)a > (long)b); break;
+            case LOC_OP_LE:    BINOP((long)a <= (long)b); break;
+            case LOC_OP_LT:    BINOP((long)a < (long)b); break;
+            case LOC_OP_NE:    BINOP((long)a != (long)b); break;
+            case LOC_OP_DIV:
+            case LOC_OP_MOD:
+                NEED(2);
+                if (!stack[si])
+                    return -1;
+                if (op->op == LOC_OP_DIV)
+                    BINOP((long)a / (long)b);
+                else
+                    BINOP(a % b);
+                break;
+            case LOC_OP_SKIP:
+                i = op->arg - 1;
+                break;
+            case LOC_OP_BRA:
+                NEED(1);
+                if (stack[si--])
+                    i = op->arg - 1;
+                break;
+            case LOC_OP_STACK_VALUE:
+                kind = OHM_LOC_VALUE;
+                break;
+            case LOC_OP_IMPLICIT:
+                kind = OHM_LOC_VALUE;
+                PUSH(op->arg);
+                break;
+            case LOC_OP_PIECE:
+                if (_add_piece(val, kind, stack, si, op->arg) < 0)
+                    return -1;
+                si = -1;
+                kind = OHM_LOC_MEMORY;
+                break;
+            default:
+                return -1;
+        }
+    }
+
+#undef PUSH
+#undef NEED
+#undef BINOP
+
+    if (i < r->nops)
+        return -1;
+
+    // an expression without pieces describes all of the variable
+    if (!val->npieces) {
+        if (si < 0 || kind == OHM_LOC_NONE)
+            return -1;
+        _add_piece(val, kind, stack, si, 0);
+    }
+    return 0;
+}
+
+int
+read_loc_value(loc_value_t *val, size_t offset, void *buf, size_t size,
+               loc_frame_t *f)
+{
+    loc_piece_t *p;
+    size_t poff, psize, lo, hi;
+    unsigned int i;
+
+    for (i = 0, poff = 0; i < val->npieces && poff < offset + size; i++) {
+        p = &val->pieces[i];
+        psize = p->size ? p->size : (offset + size - poff);
+        lo = (offset > poff) ? offset : poff;
+        hi = (offset + size < poff + psize) ? offset + size : poff + psize;
+        if (lo < hi) {
+            switch (p->kind) {
+                case OHM_LOC_MEMORY:
+                    if (f->read_mem(f, p->val + (lo - poff),
+                                    (char *)buf + (lo - offset), hi - lo) < 0)
+                        return -1;
+                    break;
+                case OHM_LOC_VALUE:
+                    // values wider than a register come in pieces, and
+                    // the host is little-endian like the target.
+                    memset((char *)buf + (lo - offset), 0, hi - lo);
+                    if (lo - poff < sizeof(p->val))
+                        memcpy((char *)buf + (lo - offset),
+                               (char *)&p->val + (lo - poff),
+                               ((hi - poff < sizeof(p->val)) ? hi - poff
+                                : sizeof(p->val)) - (lo - poff));
+                    break;
+                default:
+                    return -1;
+            }
+        }
+        poff += psize;
+    }
+    return (poff < offset + size) ? -1 : 0;
+}
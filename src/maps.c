@@ -0,0 +1,238 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <elf.h>
+
+#include "ohmd.h"
+
+// The objects (the executable and its shared libraries) mapped into
+// the probed process. Their symbols are read at their link-time
+// addresses and moved by the load bias of the object, which is zero
+// for non-PIE executables.
+typedef struct object_t object_t;
+struct object_t
+{
+    const char *path;
+    addr_t      bias;
+};
+
+static object_t     *objects;
+static unsigned int  objects_size;
+static unsigned int  objects_cap;
+
+// when /proc/<pid>/maps was last read, and a hash of its executable
+// mappings then
+static time_t   maps_last_update;
+static uint32_t maps_code_hash;
+
+static object_t *
+_find_object(const char *path)
+{
+    unsigned int i;
+
+    for (i = 0; i < objects_size; i++)
+        if (!strcmp(objects[i].path, path))
+            return &objects[i];
+    return NULL;
+}
+
+static object_t *
+_add_object(const char *path, addr_t bias)
+{
+    object_t *o;
+
+    if (objects_size == objects_cap) {
+        o = ohm_grow(objects, &objects_cap, sizeof(*o));
+        if (!o)
+            return NULL;
+        objects = o;
+    }
+
+    o = &objects[objects_size++];
+    o->path = ohm_intern(path);
+    o->bias = bias;
+    return o;
+}
+
+// get an entry of the auxiliary vector of a process
+static int
+_get_auxv(pid_t pid, unsigned long type, addr_t *val)
+{
+    int fd, ret = -1;
+    char path[64];
+    unsigned long av[2];
+
+    snprintf(path, sizeof(path), "/proc/%d/auxv", pid);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    while (read(fd, av, sizeof(av)) == sizeof(av) && (av[0] != AT_NULL)) {
+        if (av[0] == type) {
+            *val = av[1];
+            ret = 0;
+            break;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+// The executable is scanned before it is run. Once it has been exec'd,
+// we know where it got loaded, and move its symbols there.
+int
+maps_initialize(pid_t pid, char *exe)
+{
+    char path[64], exepath[PATH_MAX];
+    ssize_t len;
+    addr_t at_entry, entry, base, bias;
+    symbols_mark_t m = { 0, 0, 0 };
+
+    if ((_get_auxv(pid, AT_ENTRY, &at_entry) < 0) ||
+        (get_elf_load_info(exe, &entry, &base) < 0)) {
+        derror("unable to find the load address of %s.", exe);
+        return -1;
+    }
+    bias = at_entry - entry;
+
+    // the mappings refer to the executable by its full path.
+    snprintf(path, sizeof(path), "/proc/%d/exe", pid);
+    len = readlink(path, exepath, sizeof(exepath)-1);
+    if (len < 0) {
+        derror("unable to read the link %s.", path);
+        return -1;
+    }
+    exepath[len] = 0;
+
+    if (!_add_object(exepath, bias))
+        return -1;
+
+    if (bias) {
+        relocate_symbols(&m, bias);
+        resolve_functions();
+    }
+    ddebug("%s loaded at bias 0x%lx.", exepath, bias);
+    return 0;
+}
+
+// look for the objects that were mapped since the last update (e.g.
+// by dlopen) and load the symbols of those that have debug
+// information, either in them or in a separate debug file. The maps
+// are read at most once a second. Objects are only looked for if
+// "scan" is set, but "changed" is always set if the code mapped into
+// the process changed since the last update. Returns the number of
+// objects whose symbols were loaded.
+int
+maps_update(pid_t pid, object_scan_cb_t scan, bool *changed)
+{
+    FILE *f;
+    int n = 0, ret;
+    char line[PATH_MAX + 128], path[PATH_MAX], perms[8];
+    unsigned long start, end, offset;
+    addr_t entry, base, bias;
+    symbols_mark_t m;
+    debuginfo_t di;
+    time_t now;
+    uint32_t hash = 2166136261U;
+    char *s;
+
+    *changed = false;
+    now = time(NULL);
+    if (now == maps_last_update)
+        return 0;
+    maps_last_update = now;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx %7s %lx %*s %*s %4095[^\n]", &start, &end,
+                   perms, &offset, path) != 5)
+            continue;
+
+        if (perms[2] == 'x')
+            for (s = line; *s; s++)
+                hash = (hash ^ (unsigned char)*s) * 16777619U;
+
+        // the first mapping of a file is the one at offset zero.
+        if (!scan || (path[0] != '/') || offset || _find_object(path))
+            continue;
+
+        if (get_elf_load_info(path, &entry, &base) < 0) {
+            _add_object(path, 0);
+            continue;
+        }
+        bias = start - (base & ~((addr_t)sysconf(_SC_PAGESIZE)-1));
+        if (!_add_object(path, bias))
+            break;
+
+        if (find_debuginfo(path, &di) < 0)
+            continue;
+
+        // the types of each object get their own range of ids.
+        types_id_base = OHM_TYPE_ID_BASE(objects_size-1);
+        mark_symbols(&m);
+        ret = scan(path);
+        types_id_base = 0;
+
+        // whatever was loaded has to be resolved and moved, even if
+        // the scan failed part way through.
+        resolve_types();
+        resolve_variables();
+        relocate_symbols(&m, bias);
+        resolve_functions();
+        if (ret >= 0) {
+            ddebug("%s loaded at bias 0x%lx.", path, bias);
+            n++;
+        }
+    }
+
+    fclose(f);
+    *changed = (hash != maps_code_hash);
+    maps_code_hash = hash;
+    return n;
+}
+
+// find the mapping of the process that "addr" is in
+int
+maps_find(pid_t pid, addr_t addr, addr_t *lo, addr_t *hi)
+{
+    FILE *f;
+    int ret = -1;
+    char line[PATH_MAX + 128], path[64];
+    unsigned long start, end;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%lx-%lx", &start, &end) != 2)
+            continue;
+        if ((addr >= start) && (addr < end)) {
+            *lo = start;
+            *hi = end;
+            ret = 0;
+            break;
+        }
+    }
+
+    fclose(f);
+    return ret;
+}
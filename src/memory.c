@@ -0,0 +1,611 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+// process_vm_readv() and IOV_MAX are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#if HAVE_CMA && HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+
+#include "ohmd.h"
+
+// The memory of the target can be read in a few ways, depending on
+// what the kernel and its security policy allow:
+//
+//   cma      process_vm_readv, many parts of the target per call
+//   procmem  pread of /proc/<pid>/mem, which only the tracer may open
+//   ptrace   PTRACE_PEEKDATA, a word at a time
+//   xpmem    the heap and the stack of the target, mapped into ours
+//
+// All of those that work are tried on the target when we attach to
+// it, and the fastest one that can read each of its mappings is then
+// used for that mapping.
+typedef struct mem_backend_t mem_backend_t;
+struct mem_backend_t
+{
+    const char    *name;
+    unsigned int   caps;
+    int          (*attach)(pid_t pid);
+    void         (*detach)(void);
+    int          (*read)(void *dst, addr_t src, size_t size);
+    void         (*readv)(remote_read_t *r, unsigned int n);
+    bool           usable;
+    double         cost;    // the time it took to run the benchmark
+};
+
+// A mapping of the target, and the backends that can read it.
+typedef struct mem_region_t mem_region_t;
+struct mem_region_t
+{
+    addr_t        lo;
+    addr_t        hi;
+    unsigned int  backends;
+};
+
+// how much of the target the benchmark reads, and how many times
+#define OHM_MEM_BENCH_SIZE   (64 << 10)
+#define OHM_MEM_BENCH_ROUNDS 3
+
+// how often, at most, the mappings are read again when the target
+// reads at an address outside of all of those we know of
+#define OHM_MEM_REFRESH_SECS 1.0
+
+static pid_t mem_pid;
+static int   mem_fd = -1;
+
+static mem_region_t *regions;
+static unsigned int  nregions;
+static unsigned int  regions_cap;
+static struct timespec regions_time;
+
+/**********************************************************************/
+
+#if HAVE_CMA
+static mem_backend_t cma_backend;
+
+// process_vm_readv fails for good, rather than because of the part of
+// the target it was asked to read, if it is not allowed at all.
+static void
+_cma_check(int err)
+{
+    if ((err != EPERM) && (err != ENOSYS))
+        return;
+    if (cma_backend.usable)
+        derror("process_vm_readv is not available (%s).", strerror(err));
+    cma_backend.usable = false;
+}
+
+static int
+_cma_attach(pid_t pid)
+{
+    return 0;
+}
+
+static int
+_cma_read(void *dst, addr_t src, size_t size)
+{
+    struct iovec local[1], remote[1];
+    ssize_t ret;
+    size_t n;
+
+    for (n = 0; n < size; n += ret) {
+        local[0].iov_base = (char *)dst + n;
+        local[0].iov_len = size - n;
+        remote[0].iov_base = (void *)(src + n);
+        remote[0].iov_len = size - n;
+        ret = process_vm_readv(mem_pid, local, 1, remote, 1, 0);
+        if (ret <= 0) {
+            if (ret < 0)
+                _cma_check(errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void
+_cma_readv(remote_read_t *r, unsigned int n)
+{
+    static struct iovec local[IOV_MAX], remote[IOV_MAX];
+    unsigned int i, j, cnt;
+    ssize_t ret;
+
+    for (i = 0; i < n; i += j) {
+        cnt = ((n - i) < IOV_MAX) ? (n - i) : IOV_MAX;
+        for (j = 0; j < cnt; j++) {
+            local[j].iov_base = r[i+j].dst;
+            local[j].iov_len = r[i+j].len;
+            remote[j].iov_base = (void *)r[i+j].src;
+            remote[j].iov_len = r[i+j].len;
+        }
+
+        // the kernel stops at the first part that cannot be read, we
+        // go on with the one after it.
+        ret = process_vm_readv(mem_pid, local, cnt, remote, cnt, 0);
+        if (ret < 0)
+            _cma_check(errno);
+        for (j = 0; (j < cnt) && (ret >= (ssize_t)r[i+j].len); j++) {
+            ret -= r[i+j].len;
+            r[i+j].ok = true;
+        }
+        if (j < cnt)
+            r[i+j++].ok = false;
+    }
+}
+
+static mem_backend_t cma_backend = {
+    "cma", OHM_MEM_VECTORED | OHM_MEM_RUNNING,
+    _cma_attach, NULL, _cma_read, _cma_readv
+};
+#endif
+
+/**********************************************************************/
+
+static int
+_procmem_attach(pid_t pid)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/mem", pid);
+    mem_fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (mem_fd < 0) {
+        ddebug("unable to open %s: %s.", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void
+_procmem_detach(void)
+{
+    if (mem_fd >= 0)
+        close(mem_fd);
+    mem_fd = -1;
+}
+
+static int
+_procmem_read(void *dst, addr_t src, size_t size)
+{
+    ssize_t ret;
+    size_t n;
+
+    for (n = 0; n < size; n += ret) {
+        ret = pread(mem_fd, (char *)dst + n, size - n, src + n);
+        if ((ret < 0) && (errno == EINTR)) {
+            ret = 0;
+            continue;
+        }
+        if (ret <= 0)
+            return -1;
+    }
+    return 0;
+}
+
+// /proc/<pid>/mem is read at one offset at a time, so preadv would
+// not help with reads all over the target.
+static mem_backend_t procmem_backend = {
+    "procmem", OHM_MEM_RUNNING,
+    _procmem_attach, _procmem_detach, _procmem_read, NULL
+};
+
+/**********************************************************************/
+
+static int
+_ptrace_attach(pid_t pid)
+{
+    return 0;
+}
+
+static int
+_ptrace_read(void *dst, addr_t src, size_t size)
+{
+    unsigned long w;
+    size_t i, n;
+
+    for (i = 0; i < size; i += sizeof(w)) {
+        errno = 0;
+        w = ptrace(PTRACE_PEEKDATA, mem_pid, src + i, 0);
+        if (errno)
+            return -1;
+        n = (size - i < sizeof(w)) ? size - i : sizeof(w);
+        memcpy((char *)dst + i, &w, n);
+    }
+    return 0;
+}
+
+static mem_backend_t ptrace_backend = {
+    "ptrace", 0,
+    _ptrace_attach, NULL, _ptrace_read, NULL
+};
+
+/**********************************************************************/
+
+#if HAVE_XPMEM
+static int
+_xpmem_read(void *dst, addr_t src, size_t size)
+{
+    return (xpmem_copy(dst, (void *)src, size) < 0) ? -1 : 0;
+}
+
+static mem_backend_t xpmem_backend = {
+    "xpmem", OHM_MEM_RUNNING,
+    xpmem_attach_mem, xpmem_detach_mem, _xpmem_read, NULL
+};
+#endif
+
+/**********************************************************************/
+
+// all of the backends, ranked from the fastest once we attach
+static mem_backend_t *backends[] = {
+#if HAVE_CMA
+    &cma_backend,
+#endif
+    &procmem_backend,
+#if HAVE_XPMEM
+    &xpmem_backend,
+#endif
+    &ptrace_backend,
+};
+
+#define OHM_MEM_NBACKENDS   (sizeof(backends) / sizeof(backends[0]))
+
+static mem_backend_t *mem_forced;
+
+int
+mem_select(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < OHM_MEM_NBACKENDS; i++) {
+        if (!strcmp(backends[i]->name, name)) {
+            mem_forced = backends[i];
+            return 0;
+        }
+    }
+    derror("unknown memory backend %s.", name);
+    return -1;
+}
+
+static double
+_elapsed(struct timespec *t0)
+{
+    struct timespec t1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1E9;
+}
+
+// time the reads of a sample of the mapping [lo, hi): a large read,
+// and a lot of small ones all over it. The best of a few rounds is
+// the cost of the backend.
+static double
+_benchmark(mem_backend_t *b, addr_t lo, addr_t hi, char *buf)
+{
+    static remote_read_t r[64];
+    struct timespec t0;
+    double t, best = -1;
+    size_t size, step;
+    unsigned int i, k;
+
+    size = (hi - lo < OHM_MEM_BENCH_SIZE) ? hi - lo : OHM_MEM_BENCH_SIZE;
+    step = size / 64;
+    for (i = 0; i < 64; i++) {
+        r[i].dst = buf + i * sizeof(long);
+        r[i].src = lo + i * step;
+        r[i].len = sizeof(long);
+    }
+
+    for (k = 0; k < OHM_MEM_BENCH_ROUNDS; k++) {
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        if (b->read(buf, lo, size) < 0)
+            return -1;
+        if (b->readv)
+            b->readv(r, 64);
+        else
+            for (i = 0; i < 64; i++)
+                r[i].ok = (b->read(r[i].dst, r[i].src, r[i].len) == 0);
+        for (i = 0; i < 64; i++)
+            if (!r[i].ok)
+                return -1;
+        t = _elapsed(&t0);
+        if ((best < 0) || (t < best))
+            best = t;
+    }
+    return best;
+}
+
+// read the mappings of the target. The one to benchmark the backends
+// on is its stack, which all of them can read.
+static int
+_read_regions(addr_t *bench_lo, addr_t *bench_hi)
+{
+    FILE *f;
+    char line[PATH_MAX + 128], path[64], perms[8];
+    unsigned long start, end;
+    mem_region_t *r;
+
+    snprintf(path, sizeof(path), "/proc/%d/maps", mem_pid);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    nregions = 0;
+    if (bench_hi)
+        *bench_lo = *bench_hi = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if ((sscanf(line, "%lx-%lx %7s", &start, &end, perms) != 3) ||
+            (perms[0] != 'r'))
+            continue;
+
+        if (nregions == regions_cap) {
+            r = ohm_grow(regions, &regions_cap, sizeof(*r));
+            if (!r)
+                break;
+            regions = r;
+        }
+        r = &regions[nregions++];
+        r->lo = start;
+        r->hi = end;
+        r->backends = 0;
+        if (bench_hi && (strstr(line, "[stack]") || !*bench_hi)) {
+            *bench_lo = start;
+            *bench_hi = end;
+        }
+    }
+    fclose(f);
+    clock_gettime(CLOCK_MONOTONIC, &regions_time);
+    return 0;
+}
+
+// the backends that can read the mapping "r"
+static void
+_probe_region(mem_region_t *r)
+{
+    unsigned int i;
+    long w;
+
+    r->backends = 0;
+    for (i = 0; i < OHM_MEM_NBACKENDS; i++)
+        if (backends[i]->usable &&
+            (backends[i]->read(&w, r->lo, sizeof(w)) == 0))
+            r->backends |= (1U << i);
+}
+
+static mem_region_t *
+_region_for(addr_t addr)
+{
+    unsigned int lo = 0, hi = nregions, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (addr < regions[mid].lo)
+            hi = mid;
+        else if (addr >= regions[mid].hi)
+            lo = mid + 1;
+        else
+            return &regions[mid];
+    }
+    return NULL;
+}
+
+// read the mappings of the target again, once it has created some
+// since we last did. Those that did not change keep their backends.
+static int
+_refresh_regions(void)
+{
+    mem_region_t *old, *r;
+    unsigned int i, nold, k = 0;
+
+    if (!mem_pid || (_elapsed(&regions_time) < OHM_MEM_REFRESH_SECS))
+        return -1;
+
+    nold = nregions;
+    old = malloc((nold ? nold : 1) * sizeof(*old));
+    if (!old)
+        return -1;
+    memcpy(old, regions, nold * sizeof(*old));
+    if (_read_regions(NULL, NULL) < 0) {
+        free(old);
+        return -1;
+    }
+
+    for (i = 0; i < nregions; i++) {
+        r = &regions[i];
+        while ((k < nold) && (old[k].lo < r->lo))
+            k++;
+        if ((k < nold) && (old[k].lo == r->lo) && (old[k].hi == r->hi))
+            r->backends = old[k].backends;
+        else
+            _probe_region(r);
+    }
+    free(old);
+    ddebug("read the %u mappings of process %d again.", nregions, mem_pid);
+    return 0;
+}
+
+static int
+_compare_cost(const void *a, const void *b)
+{
+    const mem_backend_t *x = *(mem_backend_t * const *)a;
+    const mem_backend_t *y = *(mem_backend_t * const *)b;
+
+    if (x->usable != y->usable)
+        return x->usable ? -1 : 1;
+    return (x->cost > y->cost) - (x->cost < y->cost);
+}
+
+int
+mem_attach(pid_t pid)
+{
+    addr_t lo, hi;
+    unsigned int i, n = 0;
+    char *buf;
+
+    mem_pid = pid;
+    for (i = 0; i < OHM_MEM_NBACKENDS; i++) {
+        backends[i]->usable = (!mem_forced || (backends[i] == mem_forced)) &&
+            (backends[i]->attach(pid) == 0);
+        n += backends[i]->usable;
+    }
+    if (!n) {
+        derror("unable to read the memory of process %d.", pid);
+        return -1;
+    }
+
+    if ((_read_regions(&lo, &hi) < 0) || (hi <= lo)) {
+        derror("unable to read the mappings of process %d.", pid);
+        return -1;
+    }
+
+    buf = malloc(OHM_MEM_BENCH_SIZE);
+    if (!buf) {
+        derror("unable to allocate memory.");
+        return -1;
+    }
+    for (i = 0; i < OHM_MEM_NBACKENDS; i++) {
+        if (!backends[i]->usable)
+            continue;
+        backends[i]->cost = _benchmark(backends[i], lo, hi, buf);
+        if (backends[i]->cost < 0)
+            ddebug("memory backend %s: cannot read the stack.", backends[i]->name);
+        else
+            ddebug("memory backend %s: %.1f us.", backends[i]->name,
+                   backends[i]->cost * 1E6);
+        // those that cannot read the stack might still be the only
+        // ones to read some other mapping.
+        if (backends[i]->cost < 0)
+            backends[i]->cost = 1E9;
+    }
+    free(buf);
+    qsort(backends, OHM_MEM_NBACKENDS, sizeof(backends[0]), _compare_cost);
+
+    for (i = 0; i < nregions; i++)
+        _probe_region(&regions[i]);
+
+    ddebug("reading the memory of process %d with %s.", pid, backends[0]->name);
+    return 0;
+}
+
+void
+mem_detach(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < OHM_MEM_NBACKENDS; i++) {
+        if (backends[i]->usable && backends[i]->detach)
+            backends[i]->detach();
+        backends[i]->usable = false;
+    }
+    nregions = 0;
+    mem_pid = 0;
+}
+
+// the fastest backend that works for the address "addr". Mappings
+// that came after we last read them are read with the fastest
+// backend first.
+static mem_backend_t *
+_backend_for(addr_t addr)
+{
+    mem_region_t *r = _region_for(addr);
+    unsigned int mask = r ? r->backends : ~0U, i;
+
+    for (i = 0; i < OHM_MEM_NBACKENDS; i++)
+        if ((mask & (1U << i)) && backends[i]->usable)
+            return backends[i];
+    return NULL;
+}
+
+unsigned int
+mem_caps(void)
+{
+    unsigned int i, caps = ~0U;
+    mem_backend_t *b;
+
+    for (i = 0; i < nregions; i++)
+        if ((b = _backend_for(regions[i].lo)) != NULL)
+            caps &= b->caps;
+    b = _backend_for(0);
+    return b ? (caps & b->caps) : 0;
+}
+
+// read at an address outside of the mappings we know of. The
+// mappings are read again, and if it is still not in any of them,
+// each backend is tried in turn, fastest first.
+static int
+_read_unknown(void *dst, addr_t src, size_t size)
+{
+    unsigned int i;
+
+    if ((_refresh_regions() == 0) && _region_for(src))
+        return mem_read(dst, src, size);
+    for (i = 0; i < OHM_MEM_NBACKENDS; i++)
+        if (backends[i]->usable &&
+            (backends[i]->read(dst, src, size) == 0))
+            return 0;
+    return -1;
+}
+
+int
+mem_read(void *dst, addr_t src, size_t size)
+{
+    mem_backend_t *b;
+
+    // a backend that stops working is not used again
+    while ((b = _backend_for(src)) != NULL) {
+        if (b->read(dst, src, size) == 0)
+            return 0;
+        if (b->usable)
+            return _region_for(src) ? -1 : _read_unknown(dst, src, size);
+    }
+    return -1;
+}
+
+void
+mem_readv(remote_read_t *r, unsigned int n)
+{
+    mem_backend_t *b;
+    unsigned int i, j, k;
+
+    // the reads are mostly sorted, so that those of a backend come
+    // in runs. The run of a backend that stops working is done again
+    // with the next one.
+    for (i = 0; i < n; i = j) {
+        b = _backend_for(r[i].src);
+        for (j = i + 1; (j < n) && (_backend_for(r[j].src) == b); j++)
+            ;
+        if (!b) {
+            for (k = i; k < j; k++)
+                r[k].ok = false;
+        } else if (b->readv)
+            b->readv(r + i, j - i);
+        else
+            for (k = i; k < j; k++)
+                r[k].ok = (b->read(r[k].dst, r[k].src, r[k].len) == 0);
+        if (b && !b->usable)
+            j = i;
+    }
+
+    // the reads outside of the mappings we know of that failed are
+    // done again, one at a time, with the other backends.
+    for (i = 0; i < n; i++)
+        if (!r[i].ok && !_region_for(r[i].src))
+            r[i].ok = (_read_unknown(r[i].dst, r[i].src, r[i].len) == 0);
+}
@@ -2,8 +2,10 @@ local inspect = require 'inspect'
 
 probes = {}
 
+-- probe {name [, freq]}: a probe is sampled "freq" times a second, or
+-- every interval given to ohmd (-i) if it has no frequency.
 function probe (p)
-   if p[1] and p[2] then
+   if p[1] then
       pprobe = {name=p[1], freq=p[2], handlers={}, buf={}, mt={}}
       setmetatable(pprobe, pprobe.mt)
       pprobe.mt.__index = function (table, key) return table.buf[key] end
@@ -22,8 +24,16 @@ function event (e)
    return function (h) for _,v in pairs(e) do table.insert(v.handlers, h[1]) end end
 end
 
-function ohm_add (tuples)
+-- the time of the last sample, in seconds since sampling started, and
+-- how late it was taken. The values of the probes read from the stack
+-- of each thread are in probes[name].threads, by thread id.
+sample_time = 0
+sample_lateness = 0
+
+function ohm_add (tuples, time, lateness, threads)
    local handlerset = {}
+   sample_time = time or 0
+   sample_lateness = lateness or 0
    -- if type(tuples) ~= "table" then return end
    for k, v in pairs(tuples) do
       local b = probes[k].buf
@@ -42,6 +52,8 @@ function ohm_add (tuples)
 	 table.insert(b, 1, v)
 	 b[b.maxlen+1] = nil
       end
+      probes[k].time = sample_time
+      probes[k].threads = threads and threads[k]
 
       -- collect handlers to run in a "set" since we do not want
       -- the same handler to run multiple times
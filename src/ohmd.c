@@ -3,6 +3,11 @@
 // and distributed under the terms of the BSD license.
 // See the COPYING file for details.
 
+// syscall(), process_vm_readv() and __WALL are GNU extensions.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #if HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -13,10 +18,12 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stddef.h>
 #include <assert.h>
 #include <signal.h>
 #include <time.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -26,6 +33,7 @@
 #include <asm/ptrace.h>
 #endif
 #include <sys/wait.h>
+#include <sys/syscall.h>
 #include <sys/user.h>
 #include <libunwind-ptrace.h>
 #if HAVE_CMA && HAVE_SYS_UIO_H
@@ -47,8 +55,15 @@
 #endif
 
 static double doctor_interval = DEFAULT_INTERVAL;
-static bool   ohm_shutdown;
+static bool   use_cache = true;
+static bool   lazy_load;
+static bool   always_stop;
+static long   coalesce_gap = OHM_COALESCE_GAP;
+static size_t stack_depth = OHM_STACK_SNAPSHOT;
+static int    nloaders;
+static volatile sig_atomic_t ohm_shutdown;
 static pid_t  ohm_cpid;
+static bool   seized;      // whether we attached to a running process
 int           ohm_debug;
 
 // Global Lua state
@@ -56,98 +71,163 @@ static lua_State *L;
 
 // Global unwind state
 static unw_addr_space_t unw_addrspace;
-static unw_cursor_t     unw_cursor;
 
 int mpi_rank;
 int mpi_size;
 
 int cur_tick;
 
-// Forward declaration
-static addr_t _get_probe_var_addr(variable_t *var);
+// size of the TLS block of the executable
+static addr_t exe_tls_size;
 
-// scan for all types or variables and  function in a given file
-// "file". The debug information defined by the DWARF format is used
-// to fetch all of the symbols from within the file. We make a list of
-// the types or functions and variables in the file.
+// add the symbol represented by a DIE to the types, variables or
+// functions table depending on its tag.
 static int
-scan_file(char *file, dwarf_query_cb_t cb)
+add_symbol_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
 {
-    int ret = DW_DLV_ERROR, fd = -1;
-    Dwarf_Debug dbg = 0;
-    Dwarf_Error err;
-    Dwarf_Handler errhand = 0;
-    Dwarf_Ptr errarg = 0;
-    Dwarf_Unsigned cu_hdr_len, abbr_off, next_cu_hdr;
-    Dwarf_Half ver_stamp, addr_sz;
-    Dwarf_Die cu_die;
-
-    fd = open(file, O_RDONLY);
-    if (fd < 0) {
-        derror("error reading file %s.", file);
-        goto error;
-    }
+    Dwarf_Error err = 0;
+    Dwarf_Half tag = 0;
 
-    if (dwarf_init(fd, DW_DLC_READ, errhand, errarg, &dbg, &err) != DW_DLV_OK) {
-        derror("dwarf_init() failed.");
-        goto error;
+    if (dwarf_tag(die, &tag, &err) != DW_DLV_OK) {
+        derror("error in dwarf_tag()");
+        return -1;
     }
 
-    while (1) {
-        ret = dwarf_next_cu_header(dbg, &cu_hdr_len, &ver_stamp, &abbr_off,
-                                   &addr_sz, &next_cu_hdr, &err);
-        if (ret == DW_DLV_ERROR) {
-            derror("error reading DWARF CU header.");
-            goto error;
-        } else if (ret == DW_DLV_NO_ENTRY)
-            break;
+    switch (tag) {
+        case DW_TAG_base_type:
+            return add_basetype_from_die(dbg, parent_die, die);
+        case DW_TAG_array_type:
+        case DW_TAG_structure_type:
+        case DW_TAG_typedef:
+        case DW_TAG_pointer_type:
+            return add_complextype_from_die(dbg, parent_die, die);
+        case DW_TAG_member:
+            return add_structmember_from_die(dbg, parent_die, die);
+        case DW_TAG_variable:
+        case DW_TAG_subprogram:
+            return add_var_from_die(dbg, parent_die, die);
+        default:
+            return -1;
+    }
+}
 
-        if (dwarf_siblingof(dbg, NULL, &cu_die, &err) == DW_DLV_ERROR)
-            derror("error getting sibling of cu.");
+// scan for all types or variables and  function in a given file
+// "file". The debug information defined by the DWARF format is used
+// to fetch all of the symbols from within the file, or from wherever
+// its debug information was split off to. We make a list of the types
+// or functions and variables in the file.
+static int
+scan_file(char *file, dwarf_query_cb_t cb)
+{
+    debuginfo_t di;
+    dwarf_file_t f;
+    int ret;
 
-        traverse_die(cb, dbg, NULL, cu_die);
-        dwarf_dealloc(dbg, cu_die, DW_DLA_DIE);
+    if (find_debuginfo(file, &di) < 0) {
+        derror("no debug information found for %s.", file);
+        return -1;
     }
 
-    if (dwarf_finish(dbg, &err) != DW_DLV_OK) {
-        derror("dwarf_finish() failed.");
+    if (dwarf_file_open(&di, &f) < 0)
         goto error;
-    }
 
-    close(fd);
+    ret = scan_cus(cb, &di, f.dbg);
+    dwarf_file_close(&f);
+    if (ret < 0)
+        goto error;
     return 1;
 
 error:
-    close(fd);
-    derror("invalid dwarf file %s.", file);
+    derror("invalid dwarf file %s.", di.path);
     return -1;
 }
 
-// read the corresponding ohm recipe file and load the Lua language
-// runtime.
+// scan all of the symbols of an object, with the parallel loader if
+// we can.
 static int
-ohmread(char *path, probe_t **probes)
+load_symbols(char *file)
 {
-    int         np;
-    char       *probe_name;
+    int ret;
 
-    probe_t    *p;
+    ret = (nloaders > 1) ?
+        scan_file_parallel(file, nloaders, &add_symbol_from_die) : 0;
+    if (ret == 0)
+        ret = scan_file(file, &add_symbol_from_die);
+    return ret;
+}
 
-    np = 0;
+// load the Lua language runtime and the corresponding ohm recipe
+// file.
+static int
+ohmload(char *path)
+{
     probe_initialize();
     L = luaL_newstate();
 
     luaL_openlibs(L);
     if (luaL_loadfile(L, "ohm.lua") || lua_pcall(L, 0, 0, 0)) {
         derror("%s", lua_tostring(L, -1));
-        goto error;
+        return -1;
     }
 
     if (luaL_loadfile(L, path) || lua_pcall(L, 0, 0, 0)) {
         derror("%s", lua_tostring(L, -1));
-        goto error;
+        return -1;
+    }
+    return 0;
+}
+
+// scan only the symbols that the probes in the ohm recipe refer to.
+// Returns 0 if we have to fall back to scanning all of them.
+static int
+scan_recipe_symbols(char *file)
+{
+    char **names = NULL, **v;
+    unsigned int i, n = 0, cap = 0;
+    int ret;
+
+    lua_getglobal(L, "probes");
+    if (!lua_istable(L, -1)) {
+        lua_pop(L, 1);
+        return 0;
     }
 
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        lua_pop(L, 1);
+        if (n + 3 > cap) {
+            v = ohm_grow(names, &cap, sizeof(*names));
+            if (!v) {
+                lua_pop(L, 2);
+                ret = -1;
+                goto out;
+            }
+            names = v;
+        }
+        ret = get_probe_symbols((char *) lua_tostring(L, -1), names+n, 3);
+        if (ret > 0)
+            n += ret;
+    }
+    lua_pop(L, 1);
+
+    ret = scan_file_lazy(file, names, n, &add_symbol_from_die);
+out:
+    for (i = 0; i < n; i++)
+        free(names[i]);
+    free(names);
+    return ret;
+}
+
+// create the probes requested by the ohm recipe.
+static int
+ohmread(char *path, probe_t **probes)
+{
+    int         np;
+    char       *probe_name;
+
+    probe_t    *p;
+
+    np = 0;
     lua_getglobal(L, "probes");
     if (!lua_istable(L, -1)) {
         lua_pop(L, 1);
@@ -162,6 +242,8 @@ ohmread(char *path, probe_t **probes)
         lua_pop(L, 1);
 
         p = new_probe(probe_name);
+        if (!p)
+            add_pending_probe(probe_name);
         if (p && probes_list_add(&probes_list, p) < 0)
             continue;
         else
@@ -177,8 +259,11 @@ error:
 static void
 usage(void)
 {
-    fprintf(stderr, "usage: " PACKAGE_NAME " [-D] [-o ohmfile]"
-                    " [-i interval] <program> <args>\n\n");
+    fprintf(stderr, "usage: " PACKAGE_NAME " [-D] [-n] [-L] [-s] [-j threads] [-C cachedir]"
+                    " [-g gap] [-S stackbytes]"
+                    " [-B cma|procmem|ptrace|xpmem]"
+                    " [-o ohmfile]"
+                    " [-i interval] <program> <args> | -p pid\n\n");
     fprintf(stderr, "Report bugs to: " PACKAGE_BUGREPORT ".");
     exit(1);
 }
@@ -186,31 +271,277 @@ usage(void)
 static int
 remote_copy(void *dst, void *src, size_t size, void *arg)
 {
-    int ret;
     // ddebug("mem read from %p to %p, size (%lu)", src, dst, size);
+    USED(arg);
+    return mem_read(dst, (addr_t)src, size);
+}
+
+// The stack of the target is unwound once per sample into a table of
+// its frames, that all of the stack probes are then found in.
+typedef struct frame_t frame_t;
+struct frame_t
+{
+    unw_cursor_t  cur;
+    addr_t        ip;
+    addr_t        cfa;      // the stack pointer of the caller, 0 if unknown
+    function_t   *fn;
+    unsigned int  regs_valid;
+    addr_t        regs[UNW_X86_64_RIP+1];
+};
+
+#define OHM_MAX_FRAMES  1024
+
+static frame_t      *frames;
+static unsigned int  nframes;
+static unsigned int  frames_cap;
+static bool          frames_valid;
+
+// unwind the stack of the target, up to main(). The CFA of a frame is
+// the stack pointer of its caller right before the call, which
+// libunwind works out from the CFI of the frame whether or not it has
+// a frame pointer.
+static int
+_unwind_frames(void *arg)
+{
+    unw_cursor_t cur;
+    unw_word_t w;
+    frame_t *fr, *f;
 
-#if HAVE_CMA
-    struct iovec local[1], remote[1];
+    if (frames_valid)
+        return nframes;
+    frames_valid = true;
+    nframes = 0;
+
+    if (unw_init_remote(&cur, unw_addrspace, arg) < 0)
+        return 0;
 
-    local[0].iov_base = dst;
-    local[0].iov_len = size;
-    remote[0].iov_base = src;
-    remote[0].iov_len = size;
-    USED(arg);
-    ret = 0;
     do {
-        ret += process_vm_readv(ohm_cpid, local, 1, remote, 1, 0);
-    } while (ret > 0 && ret < size);
-#elif HAVE_XPMEM
-    USED(arg);
-    ret = xpmem_copy(dst, src, size);
-#else
-    int i;
-    for (i = 0; (i<<3) < size; i++)
-        ret = _UPT_access_mem(unw_addrspace, (unw_word_t)((char*)src+(i<<3)),
-                              (unw_word_t*)((char*)dst+(i<<3)), 0, arg);
-#endif
-    return ret;
+        if (nframes == frames_cap) {
+            f = ohm_grow(frames, &frames_cap, sizeof(*f));
+            if (!f)
+                break;
+            frames = f;
+        }
+        fr = &frames[nframes++];
+        fr->cur = cur;
+        unw_get_reg(&cur, UNW_REG_IP, &w);
+        fr->ip = w;
+        fr->fn = get_function_by_pc(fr->ip);
+        fr->cfa = 0;
+        fr->regs_valid = 0;
+        if (unw_step(&cur) <= 0)
+            break;
+        if (unw_get_reg(&cur, UNW_REG_SP, &w) == 0)
+            fr->cfa = w;
+    } while ((fr->fn != main_fn) && (nframes < OHM_MAX_FRAMES));
+    return nframes;
+}
+
+// The frame the location programs of the probes run in.
+typedef struct ohm_frame_t ohm_frame_t;
+struct ohm_frame_t
+{
+    loc_frame_t   loc;
+    frame_t      *fr;
+    function_t   *fn;       // the function of the frame
+    bool          in_frame_base;
+    void         *arg;      // for remote_copy
+};
+
+static int
+_get_frame_reg(frame_t *fr, int reg, addr_t *val)
+{
+    unw_word_t w;
+
+    // the DWARF numbering of the x86-64 registers is libunwind's.
+    if (!fr || reg < 0 || reg > UNW_X86_64_RIP)
+        return -1;
+    if (!(fr->regs_valid & (1U << reg))) {
+        if (unw_get_reg(&fr->cur, reg, &w) < 0)
+            return -1;
+        fr->regs[reg] = w;
+        fr->regs_valid |= (1U << reg);
+    }
+    *val = fr->regs[reg];
+    return 0;
+}
+
+static int
+_frame_get_reg(loc_frame_t *f, int reg, addr_t *val)
+{
+    return _get_frame_reg(((ohm_frame_t *)f)->fr, reg, val);
+}
+
+static int
+_frame_get_cfa(loc_frame_t *f, addr_t *val)
+{
+    frame_t *fr = ((ohm_frame_t *)f)->fr;
+
+    if (!fr || !fr->cfa)
+        return -1;
+    *val = fr->cfa;
+    return 0;
+}
+
+// the frame base of a frame is given by the DW_AT_frame_base of its
+// function. That is the CFA in most code anyway.
+static int
+_frame_get_frame_base(loc_frame_t *f, addr_t *val)
+{
+    ohm_frame_t *of = (ohm_frame_t *)f;
+    loc_value_t fb;
+    int ret;
+
+    if (!of->fn || !of->fn->frame_base)
+        return _frame_get_cfa(f, val);
+
+    // the frame base cannot be relative to itself
+    if (of->in_frame_base)
+        return -1;
+    of->in_frame_base = true;
+    ret = eval_loclist(of->fn->frame_base, f, &fb);
+    of->in_frame_base = false;
+    if ((ret < 0) || (fb.npieces != 1) || (fb.pieces[0].kind == OHM_LOC_NONE))
+        return -1;
+
+    // a register holding the frame base is as good as its address
+    *val = fb.pieces[0].val;
+    return 0;
+}
+
+// the TLS block of the executable ends at the thread pointer.
+static int
+_frame_get_tls(loc_frame_t *f, addr_t offset, addr_t *addr)
+{
+    addr_t tp;
+
+    if (!exe_tls_size || (unwinder_get_tp(((ohm_frame_t *)f)->arg, &tp) < 0))
+        return -1;
+    *addr = tp - exe_tls_size + offset;
+    return 0;
+}
+
+// the value a register had on entry to the function of a frame. Only
+// the callee-saved registers still have it, in the caller's frame; the
+// argument registers are lost as soon as the callee reuses them.
+static int
+_frame_get_entry_reg(loc_frame_t *f, int reg, addr_t *val)
+{
+    frame_t *fr = ((ohm_frame_t *)f)->fr;
+
+    switch (reg) {
+        case UNW_X86_64_RBX:
+        case UNW_X86_64_RBP:
+        case UNW_X86_64_R12:
+        case UNW_X86_64_R13:
+        case UNW_X86_64_R14:
+        case UNW_X86_64_R15:
+            break;
+        case UNW_X86_64_RSP:
+            // the call pushed the return address below the CFA
+            if (_frame_get_cfa(f, val) < 0)
+                return -1;
+            *val -= sizeof(addr_t);
+            return 0;
+        default:
+            return -1;
+    }
+
+    // the caller is the next frame of the table
+    if (!fr || (fr + 1 >= frames + nframes))
+        return -1;
+    return _get_frame_reg(fr + 1, reg, val);
+}
+
+static int
+_frame_read_mem(loc_frame_t *f, addr_t addr, void *buf, size_t size)
+{
+    return (remote_copy(buf, (void *)addr, size, ((ohm_frame_t *)f)->arg) < 0)
+        ? -1 : 0;
+}
+
+static void
+_init_frame(ohm_frame_t *f, frame_t *fr, function_t *fn, void *arg)
+{
+    f->fr = fr;
+    f->fn = fn;
+    f->in_frame_base = false;
+    f->arg = arg;
+    f->loc.get_reg = _frame_get_reg;
+    f->loc.get_frame_base = _frame_get_frame_base;
+    f->loc.get_cfa = _frame_get_cfa;
+    f->loc.get_tls = _frame_get_tls;
+    f->loc.read_mem = _frame_read_mem;
+    f->loc.get_entry_reg = _frame_get_entry_reg;
+
+    // the return address of a caller might already be in the next
+    // range of the locations of its variables.
+    f->loc.pc = 0;
+    if (fr)
+        f->loc.pc = ((fr == frames) || !fr->ip) ? fr->ip : fr->ip - 1;
+}
+
+// find where the variable "var" is in the current sample
+static int
+_get_probe_var_loc(variable_t *var, loc_value_t *val, void *arg)
+{
+    ohm_frame_t f;
+    unsigned int i;
+
+    val->npieces = 0;
+    if (!var)
+        return -1;
+
+    if (is_addr(var->loctype)) {
+        val->npieces = 1;
+        val->pieces[0].kind = OHM_LOC_MEMORY;
+        val->pieces[0].val = var->addr;
+        val->pieces[0].size = 0;
+        return 0;
+    } else if (!is_locexpr(var->loctype) || !_unwind_frames(arg))
+        return -1;
+
+    // the variables that are not on the stack, like the thread-local
+    // ones, are found in the innermost frame.
+    for (i = 0; i < nframes; i++) {
+        if (var->function && (frames[i].fn != var->function))
+            continue;
+        _init_frame(&f, &frames[i], var->function, arg);
+        if (eval_loclist(var->loc, &f.loc, val) == 0)
+            return 0;
+        if (!var->function)
+            break;
+    }
+    return -1;
+}
+
+// read the value of the variable "var" in the current sample
+static int
+_read_probe_var(variable_t *var, void *buf, size_t size, void *arg)
+{
+    loc_value_t val;
+    ohm_frame_t f;
+
+    if (_get_probe_var_loc(var, &val, arg) < 0)
+        return -1;
+    _init_frame(&f, NULL, NULL, arg);
+    return read_loc_value(&val, var->offset, buf, size, &f.loc);
+}
+
+// set the location of a probe in the frame pointed to by "cur". The
+// probes that are simply in memory are read from "addr".
+static int
+_set_probe_loc(probe_t *p, void *arg)
+{
+    if (_get_probe_var_loc(p->var, &p->value, arg) < 0)
+        return -1;
+
+    if ((p->value.npieces == 1) && (p->value.pieces[0].kind == OHM_LOC_MEMORY)
+        && !p->value.pieces[0].size) {
+        p->addr = p->value.pieces[0].val + p->var->offset;
+        p->value.npieces = 0;
+    }
+    return 0;
 }
 
 #if 0
@@ -254,175 +585,376 @@ push_lua(basetype_t *t, void *buf)
 }
 #endif
 
+// The reads of one step of the read plans of all of the probes. They
+// are sorted on their address to be coalesced; the order is kept from
+// one sample to the next, when it hardly changes.
+typedef struct batch_t batch_t;
+struct batch_t
+{
+    remote_read_t *reads;
+    unsigned int   size;
+    unsigned int   cap;
+    unsigned int  *order;
+    unsigned int   norder;
+    unsigned int   order_cap;
+};
+
+static batch_t batches[OHM_PLAN_MAX_STEPS];
+
+// The ranges of the target that the reads of a batch are coalesced
+// into, and the staging buffer they are read into.
+static remote_read_t *spans;
+static unsigned int   spans_cap;
+static unsigned int  *span_first;
+static unsigned int   span_first_cap;
+static char          *staging;
+static size_t         staging_size;
+
 static int
-write_lua(probe_t *probe, addr_t addr, void *arg)
+_add_read(batch_t *b, probe_t *p, void *dst, addr_t src, size_t len)
 {
-    int ret, i, j;
-    basetype_t *t, *ot;
-    int nelem;
-    size_t elem_size;
-    addr_t iaddr;
+    remote_read_t *r;
 
-    if (!probe)
-        return -1;
+    if (b->size == b->cap) {
+        r = ohm_grow(b->reads, &b->cap, sizeof(*r));
+        if (!r)
+            return -1;
+        b->reads = r;
+    }
+    r = &b->reads[b->size++];
+    r->dst = dst;
+    r->src = src;
+    r->len = len;
+    r->probe = p;
+    r->ok = false;
+    return 0;
+}
 
-    if (!is_builtin_probe(probe->type) && !probe->var)
-        return -1;
 
-    if (is_cur_tick(probe->type)) {
-        memcpy(probe->buf, &cur_tick, sizeof(cur_tick));
-    } else if (is_cur_frame(probe->type)) {
-        printf("not implemented.");
-    } else if (is_backtrace(probe->type)) {
-        printf("not implemented.");
-    } else if (is_ptr_addr(probe->type)) {
-        memcpy(probe->buf, &addr, sizeof(addr));
-    } else {
-        t = get_type_alias(probe->var->type);
-        size_t size = get_type_size(t);
-        if (is_array(t->ohm_type)) {
-            ot = get_type_alias(t->elems[0]);
-            elem_size = get_type_size(ot);
-            nelem = (probe->num < 0) ? (get_type_nelem(t)-probe->start) : probe->num+1;
-
-            if (is_arr_ind(probe->type)) {
-                if (probe->lower) {
-                    iaddr = _get_probe_var_addr(probe->lower);
-                    int start;
-                    ret = remote_copy(&start, (void*)iaddr, sizeof(start), arg);
-                    probe->start = start;
-                    if (ret < 0)
-                        return ret;
-                }
-
-                if (probe->upper) {
-                    iaddr = _get_probe_var_addr(probe->upper);
-                    int num;
-                    ret = remote_copy(&num, (void*)iaddr, sizeof(num), arg);
-                    probe->num = num;
-                    if (ret < 0)
-                        return ret;
-                }
-
-                nelem = (probe->num < 0) ? (get_type_nelem(t)-probe->start) : probe->num+1;
-                if (size < ((probe->start+nelem) * elem_size)) {
-                    ddebug("skipping probe %s: array index out of bounds",
-                           probe->name);
-                    return 1;
-                } else {
-                    addr = (addr_t)((char*)addr+(probe->start * elem_size));
-                    size = nelem * elem_size;
-                }
-            }
-        }
-        ret = remote_copy(probe->buf, (void*)addr, size, arg);
-        if (ret < 0)
-            return ret;
-
-        if (is_deref(probe->type)) {
-            if ((t->ohm_type == OHM_TYPE_PTR) && (t->elems[0])) {
-                addr = *(uintptr_t*)probe->buf;
-                ret = remote_copy(probe->buf, (void*)addr, t->elems[0]->size, arg);
-                if (ret < 0)
-                    return ret;
-            }
-        } else if (is_struct_mem(probe->type)) {
-            if ((t->ohm_type == OHM_TYPE_PTR) && (t->elems[0])) {
-                addr = *(uintptr_t*)probe->buf + probe->start;
-                ret = remote_copy(probe->buf, (void*)addr, probe->num, arg);
-                if (ret < 0)
-                    return ret;
-            }
+// sort the reads of a batch on their address. They mostly are from
+// the last sample, so an insertion sort is about linear.
+static int
+_sort_reads(batch_t *b)
+{
+    unsigned int i, j, k, *order;
+
+    if (b->norder != b->size) {
+        while (b->order_cap < b->size) {
+            order = ohm_grow(b->order, &b->order_cap, sizeof(*order));
+            if (!order)
+                return -1;
+            b->order = order;
         }
+        for (i = 0; i < b->size; i++)
+            b->order[i] = i;
+        b->norder = b->size;
     }
 
-    lua_pushstring(L, probe->name);
-    if ((is_array(t->ohm_type) && (nelem > 1))
-        || is_struct(t->ohm_type))
-        lua_newtable(L);
+    for (i = 1; i < b->size; i++) {
+        k = b->order[i];
+        for (j = i; j > 0 && b->reads[b->order[j-1]].src > b->reads[k].src; j--)
+            b->order[j] = b->order[j-1];
+        b->order[j] = k;
+    }
+    return 0;
+}
 
-    size_t offset = 0;
-    int start;
-    if (is_array(t->ohm_type)) {
-        if (is_arr_ind(probe->type)) {
-            start = probe->start;
-        } else {
-            start = 0;
+// merge the sorted reads of a batch that overlap or are less than
+// "coalesce_gap" bytes apart. Returns the number of spans.
+static int
+_coalesce_reads(batch_t *b)
+{
+    remote_read_t *r, *sp = NULL;
+    unsigned int i, n = 0;
+    size_t size = 0;
+    void *p;
+
+    for (i = 0; i < b->size; i++) {
+        r = &b->reads[b->order[i]];
+        if (sp && (r->src <= sp->src + sp->len + coalesce_gap)) {
+            if (r->src + r->len > sp->src + sp->len) {
+                size += r->src + r->len - (sp->src + sp->len);
+                sp->len = r->src + r->len - sp->src;
+            }
+            continue;
         }
 
-        for (i = start, j = 1; i < start+nelem; i++, j++) {
-            if (nelem > 1) {
-                lua_pushnumber(L, j);
-            }
-            lua_pushbuf(L, ot, probe->buf+offset);
-            offset += elem_size;
+        if (n == spans_cap) {
+            if (!(p = ohm_grow(spans, &spans_cap, sizeof(*spans))))
+                return -1;
+            spans = p;
+        }
+        if (n == span_first_cap) {
+            if (!(p = ohm_grow(span_first, &span_first_cap, sizeof(*span_first))))
+                return -1;
+            span_first = p;
+        }
+        sp = &spans[n];
+        span_first[n++] = i;
+        sp->src = r->src;
+        sp->len = r->len;
+        sp->probe = NULL;
+        size += r->len;
+    }
 
-            if (nelem > 1) {
-                lua_rawset(L, -3);
+    if (size > staging_size) {
+        if (!(p = realloc(staging, size))) {
+            derror("unable to allocate memory.");
+            return -1;
+        }
+        staging = p;
+        staging_size = size;
+    }
+    for (i = 0, size = 0; i < n; i++) {
+        spans[i].dst = staging + size;
+        size += spans[i].len;
+    }
+    return n;
+}
+
+// do all of the reads of a batch. The reads that are close together
+// are done as one, and their bytes copied out of a staging buffer.
+// The probes whose reads fail are skipped in this sample.
+static void
+remote_copyv(batch_t *b, void *arg)
+{
+    remote_read_t *r, *sp;
+    unsigned int i, j, end;
+    int nspans = -1;
+
+    if ((coalesce_gap >= 0) && (b->size > 1) && (_sort_reads(b) == 0))
+        nspans = _coalesce_reads(b);
+
+    if (nspans < 0)
+        mem_readv(b->reads, b->size);
+    else {
+        mem_readv(spans, nspans);
+        for (i = 0; i < nspans; i++) {
+            sp = &spans[i];
+            end = (i + 1 < nspans) ? span_first[i+1] : b->size;
+            for (j = span_first[i]; j < end; j++) {
+                r = &b->reads[b->order[j]];
+                if (sp->ok) {
+                    memcpy(r->dst, (char *)sp->dst + (r->src - sp->src), r->len);
+                    r->ok = true;
+                } else if (end - span_first[i] > 1)
+                    // the gaps might not be mapped
+                    mem_readv(r, 1);
             }
         }
-    } else if (is_struct(t->ohm_type)) {
-        for (i = 0; i < get_type_nelem(t); i++) {
-            ot = get_type_alias(t->elems[i]);
-            lua_pushstring(L, t->elems[i]->name);
-            lua_pushbuf(L, ot, probe->buf+offset);
-            offset += t->elems[i]->size;
-            lua_rawset(L, -3);
+    }
+
+    for (i = 0; i < b->size; i++) {
+        if (!b->reads[i].ok) {
+            derror("error reading probe %s, skipping...", b->reads[i].probe->name);
+            b->reads[i].probe->valid = false;
         }
-    } else
-        for (i = 0; i < get_type_nelem(t); i++) {
-            lua_pushbuf(L, t, probe->buf+i);
+    }
+}
+
+// get a probe ready to be read in this sample. Returns 0 if it cannot
+// be read.
+static int
+_prepare_probe(probe_t *probe, void *arg)
+{
+    read_plan_t *rp = &probe->plan;
+    int start, num;
+
+    // the plan of an array probe with dynamic bounds only changes
+    // along with them.
+    if (probe->lower) {
+        if (_read_probe_var(probe->lower, &start, sizeof(start), arg) < 0)
+            return -1;
+        probe->start = start;
+    }
+    if (probe->upper) {
+        if (_read_probe_var(probe->upper, &num, sizeof(num), arg) < 0)
+            return -1;
+        probe->num = num;
+    }
+    if (((probe->start != rp->start) || (probe->num != rp->num)) &&
+        (update_read_plan(probe) < 0))
+        return -1;
+    return (rp->nsteps > 0);
+}
+
+// do the "i"th step of the read plan of a probe. The reads from the
+// target are only queued up here.
+static int
+_run_probe_step(probe_t *probe, unsigned int i, void *arg)
+{
+    plan_step_t *st = &probe->plan.steps[i];
+    ohm_frame_t f;
+
+    switch (st->src) {
+        case OHM_PLAN_LOCATION:
+            if (!probe->value.npieces)
+                return _add_read(&batches[i], probe, probe->buf,
+                                 probe->addr + st->off, st->len);
+            _init_frame(&f, NULL, NULL, arg);
+            return read_loc_value(&probe->value, probe->var->offset + st->off,
+                                  probe->buf, st->len, &f.loc);
+        case OHM_PLAN_POINTER:
+            return _add_read(&batches[i], probe, probe->buf,
+                             *(addr_t *)probe->buf + st->off, st->len);
+        case OHM_PLAN_ADDRESS:
+            memcpy(probe->buf, &probe->addr, sizeof(probe->addr));
+            break;
+        case OHM_PLAN_TICK:
+            memcpy(probe->buf, &cur_tick, sizeof(cur_tick));
+            break;
+    }
+    return 0;
+}
+
+// push the value of a probe read according to its plan into "buf"
+// onto the Lua stack.
+static void
+push_value(probe_t *probe, char *buf)
+{
+    read_plan_t *rp = &probe->plan;
+    plan_field_t *fld;
+    unsigned int i;
+
+    if (rp->table)
+        lua_newtable(L);
+    for (i = 0; i < rp->nfields; i++) {
+        fld = &rp->fields[i];
+        if (rp->table) {
+            if (fld->name)
+                lua_pushstring(L, fld->name);
+            else
+                lua_pushnumber(L, i+1);
         }
+        lua_pushbuf(L, fld->type, buf + fld->off);
+        if (rp->table)
+            lua_rawset(L, -3);
+    }
+}
 
+// add the value of a probe to the table on top of the Lua stack.
+static void
+write_lua(probe_t *probe)
+{
+    lua_pushstring(L, probe->name);
+    push_value(probe, probe->buf);
     lua_rawset(L, -3);
-    return ret;
 }
 
-static addr_t
-_get_probe_var_addr(variable_t *var) {
-    unw_word_t ip, ptr;
-    unw_cursor_t cur;
+// copy the probes out of the target. This is all that is done while
+// the target is stopped.
+static void
+sample_probes(void *arg, bool all)
+{
+    probe_t *p;
+    unsigned int i;
 
-    if (!var) {
-        return 0;
+    // the stack is unwound at most once per sample, by the first
+    // probe that needs it. Only the probes that are due are sampled,
+    // and only those read from the registers or the stack unless
+    // "all" is set.
+    frames_valid = false;
+    for (p = probes_list; p != NULL; p = p->next) {
+        p->addr = 0;
+        p->value.npieces = 0;
+        p->valid = p->due && (all || probe_needs_stop(p));
+        if (p->valid && p->var)
+            _set_probe_loc(p, arg);
     }
 
-    switch (var->loctype) {
-        case OHM_ADDRESS:
-            return var->addr;
-            break;
+    for (p = probes_list; p != NULL; p = p->next) {
+        p->valid = p->valid &&
+            (p->addr || p->value.npieces || is_builtin_probe(p->type));
+        if (p->valid && (_prepare_probe(p, arg) <= 0))
+            p->valid = false;
+    }
 
-        default:
-            // copy the cursor so we can move back
-            cur = unw_cursor;
-            do {
-                // unwind the stack to read as many probes as possible
-                unw_get_reg(&cur, UNW_REG_IP, &ip);
-                if (in_function(var->function, ip)) {
-                    // Get the probe location
-                    if (is_fbreg(var->loctype)) {
-                        unw_get_reg(&cur, UNW_X86_64_RBP, &ptr);
-                        ptr = ptr+16+var->offset;
-                    } else if (is_reg(var->loctype)) {
-                        unw_get_reg(&cur, var->offset, &ptr);
-                    } else if (is_literal(var->loctype)) {
-                        ptr = var->offset;
-                    } else
-                        derror("don't know how to read probe, skipping...");
-                    // copy it to the Lua Land.
-                    return ptr;
-                }
-            } while (!in_main(ip) && (unw_step(&cur) > 0));
-            break;
+    // the reads of each step of the plans are done in one batch, so
+    // that it takes as many batches as pointers to follow.
+    for (i = 0; i < OHM_PLAN_MAX_STEPS; i++) {
+        batches[i].size = 0;
+        for (p = probes_list; p != NULL; p = p->next) {
+            if (p->valid && (i < p->plan.nsteps) &&
+                (_run_probe_step(p, i, arg) < 0)) {
+                derror("error in probe %s, skipping...", p->name);
+                p->valid = false;
+            }
+        }
+        remote_copyv(&batches[i], arg);
     }
-    return 0;
 }
 
+// The values that the probes read from the registers or the stack
+// took in each of the threads at the last sample. They are copied out
+// of the buffers of the probes, which every thread sampled overwrites.
+typedef struct thread_value_t thread_value_t;
+struct thread_value_t
+{
+    probe_t     *probe;
+    pid_t        tid;
+    size_t       off;        // offset into thread_bufs
+    size_t       size;
+    int          start;      // the array bounds of the plan it was read by
+    int          num;
+};
+
+static thread_value_t *thread_values;
+static unsigned int    nthread_values;
+static unsigned int    thread_values_cap;
+static char           *thread_bufs;
+static unsigned int    thread_bufs_size;
+static unsigned int    thread_bufs_cap;
+
+// keep the values of the probes just sampled in the thread "tid"
+static void
+save_thread_values(pid_t tid)
+{
+    thread_value_t *v;
+    probe_t *p;
+    void *vec;
+
+    for (p = probes_list; p != NULL; p = p->next) {
+        if (!p->valid || !probe_needs_stop(p))
+            continue;
+
+        if (nthread_values >= thread_values_cap) {
+            vec = ohm_grow(thread_values, &thread_values_cap,
+                           sizeof(*thread_values));
+            if (!vec)
+                return;
+            thread_values = vec;
+        }
+        while (thread_bufs_size + p->bufsize > thread_bufs_cap) {
+            vec = ohm_grow(thread_bufs, &thread_bufs_cap, 1);
+            if (!vec)
+                return;
+            thread_bufs = vec;
+        }
+
+        v = &thread_values[nthread_values++];
+        v->probe = p;
+        v->tid = tid;
+        v->off = thread_bufs_size;
+        v->size = p->bufsize;
+        v->start = p->plan.start;
+        v->num = p->plan.num;
+        memcpy(thread_bufs + v->off, p->buf, p->bufsize);
+        thread_bufs_size += p->bufsize;
+    }
+}
 
+// hand the last sample of the probes over to the recipe, along with
+// when it was taken and how late that was, in seconds, and the values
+// of the probes in each thread. The probes keep it in their buffers
+// until they are sampled again, so this can be done once the target
+// is running again.
 static void
-probe(void *arg)
+report_probes(uint64_t time, uint64_t lateness)
 {
+    thread_value_t *v;
     probe_t *p;
+    unsigned int i;
+    int n = 0;
 
     lua_getglobal(L, "ohm_add");
     if(!lua_isfunction(L, -1)) {
@@ -430,42 +962,468 @@ probe(void *arg)
         return;
     }
 
+    for (p = probes_list; p != NULL; p = p->next)
+        n += p->valid;
+    lua_createtable(L, 0, n);
+    for (p = probes_list; p != NULL; p = p->next)
+        if (p->valid)
+            write_lua(p);
+    lua_pushnumber(L, time / 1E9);
+    lua_pushnumber(L, lateness / 1E9);
+
+    // a table of the values of each probe by thread id. The plan of a
+    // probe might have been worked out again for the dynamic bounds of
+    // a later thread, in which case the values read by the old plan
+    // cannot be decoded and are left out.
     lua_newtable(L);
-    for (p = probes_list; p != NULL; p = p->next) {
-        addr_t addr = _get_probe_var_addr(p->var);
-        if (!addr && !is_builtin_probe(p->type))
+    for (i = 0; i < nthread_values; i++) {
+        v = &thread_values[i];
+        p = v->probe;
+        if ((v->start != p->plan.start) || (v->num != p->plan.num))
             continue;
-
-        if (write_lua(p, addr, arg) < 0)
-            derror("error in probe, skipping...");
+        lua_getfield(L, -1, p->name);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -3, p->name);
+        }
+        push_value(p, thread_bufs + v->off);
+        lua_rawseti(L, -2, v->tid);
+        lua_pop(L, 1);
     }
 
-    if (lua_pcall(L, 1, 0, 0) != 0) {
+    if (lua_pcall(L, 4, 0, 0) != 0) {
         derror("error adding value: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
         return;
     }
     ++cur_tick;
 }
 
+// check whether any of the probes due needs the target to be stopped
+static bool
+_probes_need_stop(void)
+{
+    probe_t *p;
+
+    for (p = probes_list; p != NULL; p = p->next)
+        if (p->due && probe_needs_stop(p))
+            return true;
+    return false;
+}
+
+// get how often the probe "name" of the recipe is to be sampled, from
+// its frequency in Hz, or every interval if it has none.
+static double
+_probe_period(const char *name)
+{
+    double freq = 0;
+
+    lua_getglobal(L, "probes");
+    if (lua_istable(L, -1)) {
+        lua_getfield(L, -1, name);
+        if (lua_istable(L, -1)) {
+            lua_getfield(L, -1, "freq");
+            freq = lua_tonumber(L, -1);
+            lua_pop(L, 1);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return (freq > 0) ? 1 / freq : doctor_interval;
+}
+
+// schedule the probes that were activated since we last did
+static void
+_schedule_probes(void)
+{
+    probe_t *p;
+
+    for (p = probes_list; p != NULL; p = p->next)
+        if (!p->period)
+            sched_add(p, _probe_period(p->name));
+}
+
+// the stops of the threads of the target wake us up, so that they are
+// not left stopped until the next sample.
+static void
+_wakeup(int sig)
+{
+}
+
+// The threads of the target. Each has its registers and its stack, and
+// so its own values of the probes read from them. The first thread is
+// the main thread of the target.
+typedef struct thread_t thread_t;
+struct thread_t
+{
+    pid_t        tid;
+    unwinder_t  *unw;
+    bool         stopped;
+    bool         stopping;   // it has yet to report the stop we sent it
+    int          status;     // of its last stop
+    int          sig;        // to pass on to it when it is resumed
+};
+
+static thread_t     *threads;
+static unsigned int  nthreads;
+static unsigned int  threads_cap;
+static bool          target_exited;
+
+// SIGINT and SIGTERM only tell the main loop to stop, and it then
+// detaches from the target, or terminates it if we launched it. There
+// is no going back to the main loop after a SIGSEGV, so the threads of
+// the target are let go of from here, with async-signal-safe calls
+// only. A seized thread that is running has to be stopped to be
+// detached from.
 void ohm_cleanup(int sig)
 {
+    unsigned int i;
+    int status;
+    pid_t tid;
+
     ohm_shutdown = true;
-    // ask the probed process to terminate
-    if (kill(ohm_cpid, SIGTERM) < 0)
-        perror("kill");
-    waitpid(ohm_cpid, 0, WNOHANG);
-#if HAVE_XPMEM
-    xpmem_detach_mem();
-#endif
-    exit(EXIT_SUCCESS);
+    if (sig != SIGSEGV)
+        return;
+
+    if ((ohm_cpid > 0) && !seized)
+        kill(ohm_cpid, SIGTERM);
+    for (i = 0; seized && (i < nthreads); i++) {
+        tid = threads[i].tid;
+        if ((ptrace(PTRACE_DETACH, tid, 0, 0) < 0) &&
+            (ptrace(PTRACE_INTERRUPT, tid, 0, 0) == 0) &&
+            (waitpid(tid, &status, __WALL) == tid))
+            ptrace(PTRACE_DETACH, tid, 0, 0);
+    }
+    _exit(EXIT_FAILURE);
+}
+
+static thread_t *
+_find_thread(pid_t tid)
+{
+    unsigned int i;
+
+    for (i = 0; i < nthreads; i++)
+        if (threads[i].tid == tid)
+            return &threads[i];
+    return NULL;
+}
+
+static thread_t *
+_add_thread(pid_t tid)
+{
+    thread_t *t;
+
+    if (nthreads >= threads_cap) {
+        t = ohm_grow(threads, &threads_cap, sizeof(*threads));
+        if (!t)
+            return NULL;
+        threads = t;
+    }
+    t = &threads[nthreads];
+    memset(t, 0, sizeof(*t));
+    t->tid = tid;
+    // the registers and the stack of each thread are copied
+    // once per stop for the unwinder.
+    t->unw = unwinder_create(tid, stack_depth);
+    if (!t->unw)
+        return NULL;
+    nthreads++;
+    ddebug("tracking thread %d.", tid);
+    return t;
+}
+
+static void
+_remove_thread(thread_t *t)
+{
+    unwinder_destroy(t->unw);
+    nthreads--;
+    memmove(t, t + 1, (char *)&threads[nthreads] - (char *)t);
+}
+
+// get the signal that stopped a thread, if it is one to pass on to
+// it rather than one of our own stops. The group-stops of a seized
+// target are reported with no signal.
+static int
+_stop_signal(int status)
+{
+    if (seized)
+        return ((status >> 16) == 0) ? WSTOPSIG(status) : 0;
+    if ((status >> 16) != 0)
+        return 0;
+    return (WSTOPSIG(status) != SIGSTOP) ? WSTOPSIG(status) : 0;
+}
+
+// keep track of the threads of the target from what waitpid says of
+// them. The threads it creates are traced from their first
+// instruction, and might be heard of before their parent reports
+// creating them.
+static void
+_thread_event(pid_t tid, int status)
+{
+    thread_t *t;
+    unsigned long msg;
+
+    t = _find_thread(tid);
+    if (!t && !(t = _add_thread(tid)))
+        return;
+
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+        if (tid == ohm_cpid)
+            target_exited = true;
+        _remove_thread(t);
+        return;
+    }
+    if (!WIFSTOPPED(status))
+        return;
+
+    t->stopped = true;
+    t->status = status;
+    t->sig = _stop_signal(status);
+    if (seized ? ((status >> 16) == PTRACE_EVENT_STOP) :
+        (((status >> 16) == 0) && (WSTOPSIG(status) == SIGSTOP)))
+        t->stopping = false;
+    if (((status >> 16) == PTRACE_EVENT_CLONE) &&
+        !ptrace(PTRACE_GETEVENTMSG, tid, 0, &msg) && !_find_thread(msg))
+        _add_thread(msg);
+}
+
+// handle what happened to the threads of the target, waiting until
+// they are all stopped if "all" is set.
+static int
+_wait_threads(bool all)
+{
+    unsigned int i;
+    int status;
+    pid_t tid;
+
+    while (!target_exited) {
+        for (i = 0; all && (i < nthreads) && threads[i].stopped; i++)
+            ;
+        if (all && (i == nthreads))
+            break;
+
+        tid = waitpid(-1, &status, __WALL | (all ? 0 : WNOHANG));
+        if (tid == 0)
+            break;
+        if (tid < 0) {
+            if ((errno == EINTR) && !ohm_shutdown)
+                continue;
+            if (errno == ECHILD)
+                target_exited = true;
+            else if (errno != EINTR)
+                perror("waitpid");
+            return -1;
+        }
+        _thread_event(tid, status);
+    }
+    return 0;
+}
+
+// stop all of the threads of the target to sample them, and wait
+// until they are. They are all sent their stop before we wait for any
+// of them. A process we attached to is seized rather than traced, so
+// that it can be stopped without a SIGSTOP that its job control would
+// see. The others get a SIGSTOP each, since the one of a process would
+// only stop the thread it is delivered to, as we do not pass it on.
+// A thread that stopped for some other reason before our stop got to
+// it is not sent another one, or it would never catch up with them.
+static int
+_stop_threads(void)
+{
+    thread_t *t;
+    unsigned int i;
+    int ret;
+
+    if (_wait_threads(false) < 0)
+        return -1;
+    for (i = 0; i < nthreads; i++) {
+        t = &threads[i];
+        if (t->stopped || t->stopping)
+            continue;
+        if (seized)
+            ret = ptrace(PTRACE_INTERRUPT, t->tid, 0, 0);
+        else
+            ret = syscall(SYS_tgkill, ohm_cpid, t->tid, SIGSTOP);
+        // the thread might have exited in the meantime
+        if ((ret < 0) && (errno != ESRCH))
+            return -1;
+        t->stopping = (ret == 0);
+    }
+    return _wait_threads(true);
+}
+
+// resume the threads of the target that are stopped. A seized thread
+// in a group-stop, e.g. after a ^Z, is left in it.
+static int
+_resume_threads(void)
+{
+    thread_t *t;
+    unsigned int i;
+    int ret;
+
+    for (i = 0; i < nthreads; i++) {
+        t = &threads[i];
+        if (!t->stopped)
+            continue;
+        if (seized && ((t->status >> 16) == PTRACE_EVENT_STOP) &&
+            (WSTOPSIG(t->status) != SIGTRAP))
+            ret = ptrace(PTRACE_LISTEN, t->tid, 0, 0);
+        else
+            ret = ptrace(PTRACE_CONT, t->tid, 0, t->sig);
+        // the thread might have been killed in the meantime
+        if ((ret < 0) && (errno != ESRCH))
+            return -1;
+        t->stopped = false;
+        t->sig = 0;
+    }
+    return 0;
+}
+
+// start the program to probe, stopped before its first instruction
+static pid_t
+_launch(char **argv)
+{
+    pid_t pid;
+    int status;
+
+    switch (pid = fork()) {
+        case -1:
+            perror("fork");
+            exit(EXIT_FAILURE);
+        case 0:
+            /* child */
+            ptrace(PTRACE_TRACEME, 0, 0, 0);
+            execvp(argv[0], argv);
+            derror("Can't execute `%s': %s", argv[0], strerror(errno));
+            exit(2);
+    }
+
+    /* parent */
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno == ECHILD)
+            exit(0);
+        else if (errno == EINTR)
+            continue;
+        else {
+            perror("wait");
+            exit(1);
+        }
+    }
+    if (!WIFSTOPPED(status))
+        exit(0);
+
+    ohm_cpid = pid;
+    if (ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_O_TRACECLONE) < 0)
+        derror("unable to trace the threads of process %d: %s.", pid,
+               strerror(errno));
+    if (!_add_thread(pid))
+        exit(1);
+    threads[0].stopped = true;
+    threads[0].status = status;
+    return pid;
+}
+
+// attach to all of the threads of the running process "pid", and stop
+// them. Threads might be created while we go through them, so we do
+// until there are no new ones.
+static int
+_attach(pid_t pid)
+{
+    char path[64], *s;
+    DIR *dir;
+    struct dirent *e;
+    pid_t tid;
+    bool found;
+
+    if (ptrace(PTRACE_SEIZE, pid, 0, PTRACE_O_TRACECLONE) < 0) {
+        derror("unable to attach to process %d: %s.", pid, strerror(errno));
+        return -1;
+    }
+    seized = true;
+    ohm_cpid = pid;
+    if (!_add_thread(pid))
+        return -1;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    do {
+        found = false;
+        dir = opendir(path);
+        if (!dir) {
+            derror("unable to list the threads of process %d.", pid);
+            return -1;
+        }
+        while ((e = readdir(dir)) != NULL) {
+            tid = strtol(e->d_name, &s, 10);
+            if (*s || (tid <= 0) || _find_thread(tid))
+                continue;
+            // the thread might have exited already
+            if (ptrace(PTRACE_SEIZE, tid, 0, PTRACE_O_TRACECLONE) < 0)
+                continue;
+            if (!_add_thread(tid))
+                break;
+            found = true;
+        }
+        closedir(dir);
+    } while (found);
+
+    if (_stop_threads() < 0) {
+        derror("unable to stop process %d: %s.", pid, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// detach from the process we attached to, leaving it running as it
+// was. Its threads have to be stopped to be detached from.
+static void
+_detach(void)
+{
+    unsigned int i;
+
+    if (_stop_threads() < 0)
+        return;
+    for (i = 0; i < nthreads; i++)
+        if (ptrace(PTRACE_DETACH, threads[i].tid, 0, threads[i].sig) < 0)
+            derror("unable to detach from thread %d: %s.", threads[i].tid,
+                   strerror(errno));
+    ddebug("detached from process %d.", ohm_cpid);
+}
+
+// sample the probes in the threads of the target. Those read from the
+// registers or the stack are sampled in each of the threads when they
+// are stopped, the main thread last so that the buffers of the probes
+// are left with its values.
+static void
+sample_threads(bool stopped)
+{
+    thread_t *t;
+    unsigned int i;
+
+    nthread_values = 0;
+    thread_bufs_size = 0;
+    for (i = stopped ? nthreads : 1; i-- > 0; ) {
+        t = &threads[i];
+        if (i && !t->stopped)
+            continue;
+        unwinder_reset(t->unw);
+        sample_probes(t->unw, i == 0);
+        if (stopped)
+            save_thread_values(t->tid);
+    }
 }
 
 int main(int argc, char *argv[])
 {
-    char *s, *ohmfile;
-    int c, ret, status;
-    struct timespec ts;
-    void *upt_info;
+    char *s, *ohmfile, *exe;
+    char path[64], exepath[PATH_MAX];
+    pid_t attach_pid = 0;
+    int c, ret, ndue;
+    uint64_t now, next, interval, sample_time = 0, deadline = 0;
+    struct timespec t0, t1;
+    probe_t *p;
+    bool maps_changed, stop, running_reads, sampled = false;
 
     cur_tick = 0;
 
@@ -483,14 +1441,50 @@ int main(int argc, char *argv[])
 #endif      
 
     ohmfile = DEFAULT_OHMFILE;
-    while ((c = getopt(argc, argv, "Do:i:h")) != -1) {
+    while ((c = getopt(argc, argv, "DnLsj:C:g:S:B:p:o:i:h")) != -1) {
         switch (c) {
             case 'D':
                 ohm_debug = (mpi_rank == 0);
                 break;
+            case 'n':
+                use_cache = false;
+                break;
+            case 's':
+                always_stop = true;
+                break;
+            case 'L':
+                lazy_load = true;
+                break;
+            case 'j':
+                nloaders = strtol(optarg, &s, 10);
+                if (*s != '\0' || nloaders < 1)
+                    usage();
+                break;
+            case 'C':
+                cache_set_dir(optarg);
+                break;
+            case 'g':
+                coalesce_gap = strtol(optarg, &s, 10);
+                if (*s != '\0')
+                    usage();
+                break;
+            case 'B':
+                if (mem_select(optarg) < 0)
+                    usage();
+                break;
+            case 'S':
+                stack_depth = strtoul(optarg, &s, 10);
+                if (*s != '\0')
+                    usage();
+                break;
             case 'o':
                 ohmfile = optarg;
                 break;
+            case 'p':
+                attach_pid = strtol(optarg, &s, 10);
+                if ((*s != '\0') || (attach_pid <= 0))
+                    usage();
+                break;
             case 'i':
                 doctor_interval = strtod(optarg, &s);
                 if (*s != '\0')
@@ -502,51 +1496,84 @@ int main(int argc, char *argv[])
         }
     }
 
-    if ((argc - optind) < 1)
+    if (!attach_pid && ((argc - optind) < 1))
         usage();
 
+    // the symbols of a process we attach to are those of the binary it
+    // is running.
+    exe = argv[optind];
+    if (attach_pid) {
+        snprintf(path, sizeof(path), "/proc/%d/exe", attach_pid);
+        ret = readlink(path, exepath, sizeof(exepath)-1);
+        if (ret < 0) {
+            derror("unable to find the binary of process %d.", attach_pid);
+            goto error;
+        }
+        exepath[ret] = 0;
+        exe = exepath;
+    }
+
+    // Use all of the cores to load the symbols, unless there are
+    // other ranks that might be sharing them.
+    if (!nloaders)
+        nloaders = (mpi_size > 1) ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+
     if (!doctor_interval) {
         derror("invalid interval %f.", doctor_interval);
         goto error;
     }
     ddebug("setting doctor interval to %.3f seconds.", doctor_interval);
 
-    // First we scan for the functions and types.
-    if ((ret = scan_file(argv[optind], &add_basetype_from_die)) < 0) {
-        derror("error scanning types from %s. (compile with -g)",
-               argv[optind]);
+    // The recipe is read first so that we know which symbols it needs.
+    ddebug("reading ohm prescription: %s.", ohmfile);
+    if (ohmload(ohmfile) < 0) {
+        derror("error reading ohm prescription %s.", ohmfile);
         goto error;
     }
-    if ((ret = scan_file(argv[optind], &add_complextype_from_die)) < 0) {
-        derror("error scanning types from %s. (compile with -g)",
-               argv[optind]);
+
+    // We scan for the types, functions and variables in a single pass
+    // over the debug information, unless we have done so for this
+    // binary before. In lazy mode, we only load the symbols that the
+    // recipe refers to if the binary has an index of its names.
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret = use_cache ? cache_load(exe) : 0;
+    if (ret < 0)
         goto error;
+    else if (ret == 0) {
+        ret = lazy_load ? scan_recipe_symbols(exe) : 0;
+        if (ret < 0)
+            goto error;
+        else if (ret == 0) {
+            if (load_symbols(exe) < 0) {
+                derror("error scanning symbols from %s. (compile with -g)",
+                       exe);
+                goto error;
+            }
+        } else
+            ddebug("loaded the recipe symbols lazily.");
+
+        // Since we do not topologically sort the DWARF graph, types and
+        // variables might refer to types that were defined after them.
+        // We resolve them here.
+        resolve_types();
+        resolve_variables();
+        resolve_functions();
+
+        // only one rank needs to write the cache, and only the full
+        // set of symbols is worth caching.
+        if (use_cache && (ret == 0) && (mpi_rank == 0))
+            cache_save(exe);
     }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ddebug("loaded symbols in %.3f seconds.",
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1E9);
     ddebug("%d base/complex types found.", types_table_size);
-    // Since we do not topologically sort the DWARF graph, the
-    // information of some of the array/struct types might be
-    // incorrect. We fix them here.
-    refresh_compound_sizes();
-
-    // print the types table
-    /* for (c = 0; c < types_table_size; c++) */
-    /*     printf("%d :: %s[%d] %lu (TID %d)\n", c, types_table[c].name, */
-    /*            types_table[c].nelem, types_table[c].size, */
-    /*            types_table[c].id); */
-
-    //  next we look for the variables.
-    if ((ret = scan_file(argv[optind], &add_var_from_die)) < 0) {
-        derror("error scanning variables from %s. (compile with -g)",
-               argv[optind]);
-        goto error;
-    }
     ddebug("%d variables found.", vars_table_size);
     print_all_variables();
     ddebug("%d functions found.", fns_table_size);
     print_all_functions();
 
-    // And finally, we read the OHM prescription.
-    ddebug("reading ohm prescription: %s.", ohmfile);
+    // And finally, we create the probes of the OHM prescription.
     if ((ret = ohmread(ohmfile, &probes_list)) < 0) {
         derror("error reading ohm prescription %s.", ohmfile);
         goto error;
@@ -558,81 +1585,131 @@ int main(int argc, char *argv[])
     signal(SIGINT, ohm_cleanup);
     signal(SIGTERM, ohm_cleanup);
     signal(SIGSEGV, ohm_cleanup);
+    signal(SIGCHLD, _wakeup);
 
-    switch(ohm_cpid = fork()) {
-        case -1:
-            perror("fork");
-            exit(EXIT_FAILURE);
-        case 0:
-            /* child */
-            ptrace(PTRACE_TRACEME, 0, 0, 0);
-            execvp(argv[optind], &argv[optind]);
-            derror("Can't execute `%s': %s", argv[1], strerror(errno));
-            exit(2);
-        default:
-            /* parent */
-            while (wait(&status) < 0) {
-                if (errno == ECHILD)
-                    exit(0);
-                else if (errno == EINTR)
-                    continue;
-                else {
-                    perror("wait");
-                    exit(1);
-                }
-            }
-
-#if HAVE_XPMEM
-            if (xpmem_attach_mem(ohm_cpid) < 0) {
-                derror("error mapping remote process's memory.");
-                goto error;
-            }
-#endif
-            ddebug("Probing process %u.", ohm_cpid);
-            // create the unwind address space
-            unw_addrspace = unw_create_addr_space(&_UPT_accessors, 0);
-            if (!unw_addrspace) {
-                derror("unable to create unwind address space.");
-                goto error;
-            }
-
-            // create UPT-info structure
-            upt_info = _UPT_create(ohm_cpid);
-            if (!upt_info) {
-                derror("error creating _UPT-info structure.");
-                goto error;
-            }
-
-            ts.tv_sec = (int) doctor_interval;
-            ts.tv_nsec = (doctor_interval - ts.tv_sec) * 1E9;
+    if (attach_pid) {
+        if (_attach(attach_pid) < 0)
+            goto error;
+    } else
+        _launch(&argv[optind]);
 
-            while (!WIFEXITED(status) && !WIFSIGNALED(status) && !ohm_shutdown) {
-                ret = unw_init_remote(&unw_cursor, unw_addrspace, upt_info);
-                if (ret < 0) {
-                    derror("error initializing remote upt ptrace.");
-                    goto error;
-                }
+    if (mem_attach(ohm_cpid) < 0) {
+        derror("error mapping remote process's memory.");
+        goto error;
+    }
+    // the executable might have been loaded anywhere.
+    if (maps_initialize(ohm_cpid, exe) < 0)
+        goto error;
+    if (get_elf_tls_size(exe, &exe_tls_size) < 0)
+        exe_tls_size = 0;
+
+    ddebug("Probing process %u.", ohm_cpid);
+    // create the unwind address space
+    unw_addrspace = unw_create_addr_space(&unwinder_accessors, 0);
+    if (!unw_addrspace) {
+        derror("unable to create unwind address space.");
+        goto error;
+    }
+    // the unwind information of the target does not change
+    // from one sample to the next.
+    unw_set_caching_policy(unw_addrspace, UNW_CACHE_GLOBAL);
+
+    // the globals, and whatever they point to, can be read
+    // while the target runs, when the memory backends allow it.
+    running_reads = !always_stop && (mem_caps() & OHM_MEM_RUNNING);
+    if (!running_reads)
+        ddebug("stopping the target at every sample.");
+
+    // each probe is sampled at its own rate. We wake up when
+    // the next one is due, or every interval at least, to look
+    // for new shared libraries. An interval shorter than a
+    // tick is a tick, rather than no sleep at all.
+    sched_init();
+    _schedule_probes();
+    interval = doctor_interval * 1E9 / OHM_SCHED_TICK_NS;
+    if (!interval)
+        interval = 1;
+
+    while (!target_exited && !ohm_shutdown) {
+        if (_resume_threads() < 0) {
+            derror("error resuming process %u.", ohm_cpid);
+            goto error;
+        }
 
-                if (WIFSTOPPED(status))
-                    _UPT_resume(unw_addrspace, &unw_cursor, upt_info);
+        // the recipe gets the last sample while the target runs
+        if (sampled)
+            report_probes(sample_time, sample_time - deadline);
+        sampled = false;
+
+        // the symbols of the shared libraries are loaded once
+        // they show up, if some probes are waiting for them. The
+        // unwind information cached for the old mappings is
+        // dropped when the code of the target moves around.
+        ret = maps_update(ohm_cpid, probes_pending() ? &load_symbols : NULL,
+                          &maps_changed);
+        if (maps_changed)
+            unw_flush_cache(unw_addrspace, 0, 0);
+        if (ret > 0) {
+            activate_pending_probes(&probes_list);
+            _schedule_probes();
+        }
 
-                nanosleep(&ts, NULL);
-                if (kill(ohm_cpid, SIGSTOP) < 0)
-                    perror("kill");
-                waitpid(-1, &status, 0);
+        now = sched_now();
+        next = sched_next();
+        if (next > now + interval)
+            next = now + interval;
+        if (next > now)
+            sched_sleep_until(next);
+        for (p = probes_list; p != NULL; p = p->next)
+            p->due = false;
+        ndue = sched_advance(sched_now());
+
+        // the target is only stopped when some of the probes
+        // due are read from the registers or the stacks of its
+        // threads. Otherwise, we just check that it is still
+        // there, and pass on the signals that stopped its
+        // threads in the meantime.
+        stop = ndue && (!running_reads || _probes_need_stop());
+        if (stop)
+            ret = _stop_threads();
+        else
+            ret = _wait_threads(false);
+        if ((ret < 0) || target_exited)
+            break;
 
-                if (WIFEXITED(status))
-                    break;
+        if (!ndue)
+            continue;
 
-                probe(upt_info);
-            }
+        // a sample is late by the time from when the first of
+        // its probes was due to when the target is stopped.
+        sample_time = sched_now_ns();
+        deadline = next * OHM_SCHED_TICK_NS;
+        if (deadline > sample_time)
+            deadline = sample_time;
+        sched_record_lateness(sample_time - deadline);
 
-            _UPT_destroy(upt_info);
+        sample_threads(stop);
+        sampled = true;
     }
 
-#if HAVE_XPMEM
-    xpmem_detach_mem();
-#endif
+    // the last sample is not lost if we stop before it is reported
+    if (sampled)
+        report_probes(sample_time, sample_time - deadline);
+
+    sched_report();
+    mem_detach();
+    if (!target_exited) {
+        if (seized)
+            _detach();
+        else if (ohm_shutdown) {
+            // ask the probed process to terminate
+            if (kill(ohm_cpid, SIGTERM) < 0)
+                perror("kill");
+            waitpid(ohm_cpid, 0, WNOHANG);
+        }
+    }
+    while (nthreads)
+        _remove_thread(&threads[nthreads-1]);
 
 #ifdef HAVE_MPI
     int finalized;
@@ -8,10 +8,15 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <limits.h>
 
 #include <dwarf.h>
 #include <libdwarf.h>
 
+#include <libunwind.h>
+
 #include <lua.h>
 #include <lualib.h>
 #include <lauxlib.h>
@@ -19,13 +24,39 @@
 #define DEFAULT_OHMFILE         "default.ohm"
 #define DEFAULT_INTERVAL        3.0
 
+// reads of the target less than this many bytes apart are merged; a
+// negative gap turns the merging off.
+#define OHM_COALESCE_GAP        64
+
 typedef unsigned long addr_t;
 
+// The symbol tables are thread-local so that the parallel loader can
+// fill one set of them per worker thread.
+#define OHM_TLS                 __thread
+
 /**********************************************************************/
 
-/* Types (base types and aggregate types) */
+/* Arenas */
 
-#define OHM_MAX_NUM_TYPES       2048
+#define OHM_ARENA_CHUNK_SIZE    (1 << 20)
+
+// An arena hands out memory from large chunks that are never moved or
+// individually freed.
+typedef struct ohm_arena_t ohm_arena_t;
+struct ohm_arena_t
+{
+    struct ohm_chunk_t *chunks;  // most recently allocated chunk first
+    size_t              used;    // bytes used in the current chunk
+};
+
+void *ohm_alloc(ohm_arena_t *arena, size_t size);
+void ohm_arena_free(ohm_arena_t *arena);
+void *ohm_grow(void *vec, unsigned int *cap, size_t elem_size);
+const char *ohm_intern(const char *s);
+
+/**********************************************************************/
+
+/* Types (base types and aggregate types) */
 
 // OHM types.
 #define OHM_TYPE_UNSIGNED   (1<<0)
@@ -57,19 +88,24 @@ typedef unsigned long addr_t;
 typedef struct basetype_t basetype_t;
 struct basetype_t
 {
-    unsigned int id;
+    Dwarf_Off    id;          // global offset of the type's DIE
     short        ohm_type;
-    char         name[128];
+    const char  *name;        // interned
     size_t       size;
     unsigned int nelem;
     basetype_t **elems;
 };
 
-extern basetype_t   types_table[OHM_MAX_NUM_TYPES];
-extern unsigned int types_table_size;
+extern OHM_TLS basetype_t **types_table;
+extern OHM_TLS unsigned int types_table_size;
+
+// Type ids are the global offsets of the types' DIEs. The types of
+// each shared library are told apart by its number in the top bits.
+#define OHM_TYPE_ID_BASE(obj)   ((Dwarf_Off)(obj) << 48)
+extern OHM_TLS Dwarf_Off types_id_base;
 
-basetype_t* get_type(int id);
-basetype_t* get_or_add_type(int id);
+basetype_t* get_type(Dwarf_Off id);
+basetype_t* get_or_add_type(Dwarf_Off id);
 size_t get_type_size(basetype_t *type);
 unsigned int get_type_nelem(basetype_t *type);
 basetype_t* get_type_alias(basetype_t *type);
@@ -77,28 +113,44 @@ basetype_t* get_type_ptr(basetype_t *type);
 int get_type_ohmtype(basetype_t *type);
 int add_basetype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die);
 int add_complextype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die);
+int add_structmember_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die);
+void resolve_types(void);
+void mark_types_resolved(void);
 
 /**********************************************************************/
 
 /* Functions */
 
-#define OHM_MAX_NUM_FUNCTIONS   4096
-
 typedef struct function_t function_t;
 struct function_t
 {
-    char	name[128];
+    const char *name;
     addr_t	lowpc;
     addr_t	hipc;
+    struct loclist_t *frame_base;  // DW_AT_frame_base, NULL for the CFA
 };
 
-extern function_t   fns_table[OHM_MAX_NUM_FUNCTIONS];
-extern unsigned int fns_table_size;
+extern OHM_TLS function_t **fns_table;
+extern OHM_TLS unsigned int fns_table_size;
 
 extern function_t  *main_fn;
 
+// A contiguous range of code belonging to a function. Functions with
+// a DW_AT_ranges list have more than one of these.
+typedef struct fn_range_t fn_range_t;
+struct fn_range_t
+{
+    addr_t      lowpc;
+    addr_t      hipc;
+    function_t *fn;
+};
+
+function_t* add_function(const char *name, addr_t lowpc, addr_t hipc);
+int add_function_range(function_t *f, addr_t lowpc, addr_t hipc);
+unsigned int get_function_ranges(fn_range_t **ranges);
 function_t* get_function(char *name);
-void refresh_compound_sizes(void);
+function_t* get_function_by_pc(unsigned long ip);
+void resolve_functions(void);
 int in_function(function_t *f, unsigned long ip);
 int in_main(unsigned long ip);
 void print_all_functions(void);
@@ -108,42 +160,140 @@ void print_all_functions(void);
 /* Variable Locations */
 
 // The location type of a variable.
-#define OHM_ADDRESS  (1<<0)
-#define   OHM_FBREG  (1<<1)
-#define     OHM_REG  (1<<2)
-#define OHM_LITERAL  (1<<3)
+#define OHM_ADDRESS  (1<<0)   // at a fixed address
+#define OHM_LOCEXPR  (1<<1)   // computed by a location program
 
 // Convenience macros to determine the location type
 // of the variable.
 #define    is_addr(v) ((v) & OHM_ADDRESS)
-#define   is_fbreg(v) ((v) & OHM_FBREG)
-#define     is_reg(v) ((v) & OHM_REG)
-#define is_literal(v) ((v) & OHM_LITERAL)
+#define is_locexpr(v) ((v) & OHM_LOCEXPR)
+
+// The DWARF location list of a variable is compiled, once, into a
+// program for each range of PCs over which the variable's location is
+// described by the same expression. An empty program means that the
+// variable is optimized out over its range.
+typedef struct loc_op_t loc_op_t;
+struct loc_op_t
+{
+    unsigned short op;       // one of the LOC_OP_* codes of location.c
+    unsigned short reg;      // DWARF register number
+    long           arg;
+};
 
-/* Variables */
+typedef struct loc_range_t loc_range_t;
+struct loc_range_t
+{
+    addr_t        lowpc;
+    addr_t        hipc;
+    unsigned int  nops;
+    loc_op_t     *ops;
+};
+
+typedef struct loclist_t loclist_t;
+struct loclist_t
+{
+    addr_t        bias;      // load bias of the object
+    unsigned int  nranges;
+    loc_range_t   ranges[];
+};
+
+// The location programs of a variable valid at any PC have this range.
+#define OHM_LOC_ANYPC_LOW   ((addr_t)0)
+#define OHM_LOC_ANYPC_HIGH  (~(addr_t)0)
 
-#define OHM_MAX_NUM_VARS        4096
+// Where a piece of a variable is in a frame.
+#define OHM_LOC_NONE    0     // nowhere, it is optimized out
+#define OHM_LOC_MEMORY  1     // in memory at the address "val"
+#define OHM_LOC_VALUE   2     // in a register, or computed; "val" is the value
+
+#define OHM_LOC_MAX_PIECES  8
+
+typedef struct loc_piece_t loc_piece_t;
+struct loc_piece_t
+{
+    int     kind;
+    addr_t  val;
+    size_t  size;             // 0 for the whole of the variable
+};
+
+typedef struct loc_value_t loc_value_t;
+struct loc_value_t
+{
+    unsigned int npieces;
+    loc_piece_t  pieces[OHM_LOC_MAX_PIECES];
+};
+
+// The frame a location program runs in. The registers are numbered
+// as in DWARF.
+typedef struct loc_frame_t loc_frame_t;
+struct loc_frame_t
+{
+    addr_t pc;
+    int (*get_reg)(loc_frame_t *f, int reg, addr_t *val);
+    int (*get_frame_base)(loc_frame_t *f, addr_t *val);
+    int (*get_cfa)(loc_frame_t *f, addr_t *val);
+    int (*get_tls)(loc_frame_t *f, addr_t offset, addr_t *addr);
+    int (*read_mem)(loc_frame_t *f, addr_t addr, void *buf, size_t size);
+    // the value of a register on entry to the function, if known
+    int (*get_entry_reg)(loc_frame_t *f, int reg, addr_t *val);
+};
+
+// compile the location of a variable. Returns 1 if the variable is at
+// a fixed address "addr", and 0 if it is computed by the program "loc".
+int compile_loclist(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Attribute attr,
+                    loclist_t **loc, addr_t *addr);
+// compile the "n" location descriptions "lds" of a variable, whose
+// location list entries are relative to "base"
+int compile_locdescs(Dwarf_Locdesc **lds, Dwarf_Signed n, Dwarf_Addr base,
+                     loclist_t **loc, addr_t *addr);
+loclist_t* new_loclist(unsigned int nranges);
+loc_op_t* new_loc_ops(unsigned int nops);
+void relocate_loclist(loclist_t *loc, addr_t bias);
+
+// run the location program of a variable in the frame "f"
+int eval_loclist(loclist_t *loc, loc_frame_t *f, loc_value_t *val);
+
+// read "size" bytes at "offset" into a variable from its location
+int read_loc_value(loc_value_t *val, size_t offset, void *buf, size_t size,
+                   loc_frame_t *f);
+
+/* Variables */
 
 typedef struct variable_t variable_t;
 struct variable_t
 {
-    char          name[256];
+    const char   *name;
     basetype_t   *type;
     function_t   *function;
     unsigned int  loctype;
-  union {
-    addr_t        addr;
-    signed long   offset;
-  };
+    addr_t        addr;       // the address of a variable at a fixed address
+    size_t        offset;     // offset of a struct member into its location
+    loclist_t    *loc;        // the location program of any other variable
 };
 
-extern variable_t   vars_table[OHM_MAX_NUM_VARS];
-extern unsigned int vars_table_size;
+extern OHM_TLS variable_t **vars_table;
+extern OHM_TLS unsigned int vars_table_size;
 
+variable_t* add_variable(variable_t *v);
 variable_t* get_variable(char *name);
 int add_var_location(variable_t *var, Dwarf_Debug dbg, Dwarf_Die die,
                      Dwarf_Attribute attr, Dwarf_Half form);
 int add_var_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die child_die);
+void resolve_variables(void);
+void index_variables(void);
+
+// The sizes of the symbol tables at some point, to tell the symbols of
+// an object loaded afterwards apart.
+typedef struct symbols_mark_t symbols_mark_t;
+struct symbols_mark_t
+{
+    unsigned int vars;
+    unsigned int fns;
+    unsigned int ranges;
+};
+
+void mark_symbols(symbols_mark_t *m);
+void relocate_symbols(symbols_mark_t *m, addr_t bias);
 void print_all_variables(void);
 
 /**********************************************************************/
@@ -169,31 +319,119 @@ void print_all_variables(void);
 
 #define is_builtin_probe(v) (is_cur_tick(v) && is_cur_frame(v) && is_backtrace(v))
 
+// A probe is sampled by following its read plan: a couple of steps
+// that copy bytes of the target into the probe's buffer, and the list
+// of fields to decode from the buffer. The plan is worked out from the
+// type of the probe when it is activated, and only again when the
+// dynamic bounds of an array probe change.
+#define OHM_PLAN_LOCATION  1   // from the location of the variable
+#define OHM_PLAN_POINTER   2   // from where the pointer read so far points
+#define OHM_PLAN_ADDRESS   3   // the address of the variable
+#define OHM_PLAN_TICK      4   // the sample count
+
+#define OHM_PLAN_MAX_STEPS 2
+
+typedef struct plan_step_t plan_step_t;
+struct plan_step_t
+{
+    int           src;       // OHM_PLAN_*
+    size_t        off;       // offset into the source
+    size_t        len;
+};
+
+typedef struct plan_field_t plan_field_t;
+struct plan_field_t
+{
+    basetype_t   *type;      // the type to decode the field as
+    size_t        off;       // offset into the probe's buffer
+    const char   *name;      // key of a struct member, NULL for an element
+};
+
+typedef struct read_plan_t read_plan_t;
+struct read_plan_t
+{
+    unsigned int  nsteps;    // 0 if the probe cannot be read
+    plan_step_t   steps[OHM_PLAN_MAX_STEPS];
+    bool          table;     // whether the fields are pushed as a table
+    unsigned int  nfields;
+    plan_field_t *fields;
+    int           start;     // the array bounds the plan was made for
+    int           num;
+};
+
 typedef struct probe_t probe_t;
 struct probe_t
 {
     char        name[256];   // the name of the probe
     variable_t *var;         // the variable.
     char       *buf;         // this is a buffer we read data into.
+    size_t      bufsize;
     bool        status;      // status of the probe.
     int         type;        // type of the probe
     int         start;       // start index for array probes
     int         num;         // number of elements for array probes
     variable_t *lower;       // lower dynamic array index
     variable_t *upper;       // upper dynamic array index
+    addr_t      addr;        // address of the probe in the current sample
+    loc_value_t value;       // or its location, if it is not in memory
+    read_plan_t plan;        // how to read the probe
+    bool        valid;       // whether the current sample of it was read
+    uint64_t    period;      // how often it is sampled, in scheduler ticks
+    uint64_t    expires;     // when it is next due
+    bool        due;         // whether it is sampled in the current tick
+    probe_t    *wnext;       // the probes in the same slot of the scheduler
     probe_t    *next;        // linked list of probes.
 };
 
 extern probe_t *probes_list;
 
 probe_t* new_probe(char *name);
+int update_read_plan(probe_t *p);
+int get_probe_symbols(char *name, char **syms, int max);
 int probes_list_add(probe_t **table, probe_t *probe);
+int add_pending_probe(char *name);
+bool probes_pending(void);
+int activate_pending_probes(probe_t **table);
+bool probe_needs_stop(probe_t *p);
 void print_probes(probe_t *probe);
 int probe_initialize(void);
 void probe_finalize(void);
 
 /**********************************************************************/
 
+/* Sampling scheduler */
+
+// The scheduler keeps time in ticks of this many nanoseconds.
+#define OHM_SCHED_TICK_NS   100000
+
+// start the clock of the scheduler
+void sched_init(void);
+
+// get the current time, in ticks (or nanoseconds) since the scheduler
+// was started
+uint64_t sched_now(void);
+uint64_t sched_now_ns(void);
+
+// sleep until the time "tick"
+void sched_sleep_until(uint64_t tick);
+
+// sample the probe "p" every "period" seconds, starting now
+void sched_add(probe_t *p, double period);
+
+// get the time the next probe is due at
+uint64_t sched_next(void);
+
+// mark the probes due up to the time "now", and schedule them again.
+// Returns the number of probes that are due.
+int sched_advance(uint64_t now);
+
+// keep track of how late the samples are taken, and print the
+// percentiles of it
+void sched_record_lateness(uint64_t ns);
+void sched_report(void);
+
+/**********************************************************************/
+
 /* DWARF utility functions for ohmd */
 
 // determine whether the given DWARF form is a location
@@ -212,12 +450,20 @@ int get_child_name(Dwarf_Debug dbg, Dwarf_Die child, char *name, int size);
 // compile unit
 int get_parent_name(Dwarf_Debug dbg, Dwarf_Die parent, char *name, int size);
 
-// get the offset and type ID of a die
+// get the (global) offset and type ID of a die
 int get_offset_tid(Dwarf_Die die, Dwarf_Off *offset, Dwarf_Unsigned *tid);
 
+// get the base address of the compile unit containing a die
+int get_cu_base_address(Dwarf_Debug dbg, Dwarf_Die die, Dwarf_Addr *base);
+
 // get the byte offsets (locations) of struct members
 int get_member_location(Dwarf_Die die, Dwarf_Unsigned *loc);
 
+// rewrite the operations of a location description that index the
+// .debug_addr table (DW_OP_addrx, DW_OP_constx and their GNU
+// variants) into operations on the values they index
+int resolve_addr_indexes(Dwarf_Die die, Dwarf_Locdesc *ld);
+
 // Callback function that represents the DWARF query operation.
 typedef int (*dwarf_query_cb_t)(Dwarf_Debug, Dwarf_Die, Dwarf_Die);
 
@@ -226,6 +472,193 @@ typedef int (*dwarf_query_cb_t)(Dwarf_Debug, Dwarf_Die, Dwarf_Die);
 int traverse_die(dwarf_query_cb_t cb, Dwarf_Debug dbg, Dwarf_Die parent_die,
                  Dwarf_Die child_die);
 
+typedef struct debuginfo_t debuginfo_t;
+
+// A DWARF file opened for reading. The split units of a DWARF package
+// are tied to the skeleton file that has their addresses.
+typedef struct dwarf_file_t dwarf_file_t;
+struct dwarf_file_t
+{
+    int         fd;
+    Dwarf_Debug dbg;
+    int         tied_fd;   // -1 if there is no skeleton
+    Dwarf_Debug tied_dbg;
+};
+
+// open (and close) the debug information of a binary
+int dwarf_file_open(debuginfo_t *di, dwarf_file_t *f);
+void dwarf_file_close(dwarf_file_t *f);
+
+// get the path of the .dwo file of a skeleton unit
+int get_dwo_path(Dwarf_Die cu_die, debuginfo_t *di, char *path, size_t size);
+
+// traverse the "cu"th compile unit, or its split unit (unless "di" is
+// NULL)
+int scan_cu(dwarf_query_cb_t cb, debuginfo_t *di, Dwarf_Debug dbg,
+            Dwarf_Die cu_die, unsigned int cu);
+
+// traverse all of the compile units of a DWARF file
+int scan_cus(dwarf_query_cb_t cb, debuginfo_t *di, Dwarf_Debug dbg);
+
+/**********************************************************************/
+
+/* Parallel symbol loading */
+
+// The symbol tables filled by a worker thread of the parallel loader.
+typedef struct symbols_t symbols_t;
+struct symbols_t
+{
+    basetype_t  **types;
+    unsigned int  ntypes;
+    function_t  **fns;
+    unsigned int  nfns;
+    fn_range_t   *ranges;
+    unsigned int  nranges;
+    variable_t  **vars;
+    unsigned int  nvars;
+};
+
+// hand the calling thread's tables over to "s" and reset them
+void export_types(symbols_t *s);
+void export_funcvars(symbols_t *s);
+
+// merge the tables of a worker thread into the calling thread's
+int merge_types(symbols_t *s);
+int merge_funcvars(symbols_t *s);
+void relink_types(void);
+
+// scan the compile units of a file with "nthreads" worker threads
+int scan_file_parallel(char *file, int nthreads, dwarf_query_cb_t cb);
+
+/**********************************************************************/
+
+/* Lazy symbol loading */
+
+// scan only the symbols that the probes in "names" refer to
+int scan_file_lazy(char *file, char **names, int n, dwarf_query_cb_t cb);
+
+/**********************************************************************/
+
+/* ELF utility functions for ohmd */
+
+// get the GNU build-id of an ELF file as a hex string
+int get_build_id(const char *file, char *id, size_t size);
+
+// get the entry point and the link-time base address of an ELF file
+int get_elf_load_info(const char *file, addr_t *entry, addr_t *base);
+
+// get the size of the static TLS block of an ELF file
+int get_elf_tls_size(const char *file, addr_t *size);
+
+// check whether an ELF file has a section called "name"
+bool elf_has_section(const char *file, const char *name);
+
+// Where the debug information of a binary lives.
+struct debuginfo_t
+{
+    char path[PATH_MAX];  // the file with its .debug_info
+    char dwp[PATH_MAX];   // the DWARF package of its split units, if any
+    char dir[PATH_MAX];   // the directory of the binary
+};
+
+// find the debug information of a (possibly stripped) binary
+int find_debuginfo(const char *file, debuginfo_t *di);
+
+/**********************************************************************/
+
+/* Loaded objects */
+
+// A symbol loader for the objects mapped into the probed process.
+typedef int (*object_scan_cb_t)(char *file);
+
+// find the load bias of the executable and relocate its symbols
+int maps_initialize(pid_t pid, char *exe);
+
+// scan the symbols of the objects loaded since the last update
+int maps_update(pid_t pid, object_scan_cb_t scan, bool *changed);
+
+// find the mapping of the process that "addr" is in
+int maps_find(pid_t pid, addr_t addr, addr_t *lo, addr_t *hi);
+
+/**********************************************************************/
+
+/* Target memory */
+
+// A read of the memory of the target. The reads of a sample are done
+// in batches.
+typedef struct remote_read_t remote_read_t;
+struct remote_read_t
+{
+    void    *dst;
+    addr_t   src;
+    size_t   len;
+    probe_t *probe;      // the probe whose sample fails with the read
+    bool     ok;
+};
+
+// The capabilities of the ways of reading the memory of the target.
+#define OHM_MEM_VECTORED    (1 << 0)  // many parts of it in one call
+#define OHM_MEM_RUNNING     (1 << 1)  // without stopping it
+
+// use the backend "name" (cma, procmem, ptrace or xpmem) rather than
+// the fastest one
+int mem_select(const char *name);
+
+// start (and stop) reading the memory of the process "pid"
+int mem_attach(pid_t pid);
+void mem_detach(void);
+
+// get the capabilities all of the backends in use have
+unsigned int mem_caps(void);
+
+// read "size" bytes of the target at "src"
+int mem_read(void *dst, addr_t src, size_t size);
+
+// do a number of reads at once, with as few system calls as we can
+void mem_readv(remote_read_t *r, unsigned int n);
+
+/**********************************************************************/
+
+/* Stack unwinding */
+
+// An unwinder serves libunwind from a copy of the registers and the
+// stack of a stopped thread, taken at most once per stop.
+typedef struct unwinder_t unwinder_t;
+
+// how much of the stack above the stack pointer is copied, by default
+#define OHM_STACK_SNAPSHOT  (1 << 20)
+
+// the accessors of an address space using unwinders as their argument
+extern unw_accessors_t unwinder_accessors;
+
+// create (and destroy) an unwinder for the thread "pid", that copies
+// at most "depth" bytes of its stack
+unwinder_t *unwinder_create(pid_t pid, size_t depth);
+void unwinder_destroy(unwinder_t *u);
+
+// forget the copies of the registers and the stack, once the thread
+// has run since they were taken
+void unwinder_reset(unwinder_t *u);
+
+// get the register "reg" of the thread, as numbered in libunwind
+int unwinder_get_reg(unwinder_t *u, int reg, addr_t *val);
+
+// get the base of the thread's TLS (the thread pointer)
+int unwinder_get_tp(unwinder_t *u, addr_t *val);
+
+/**********************************************************************/
+
+/* Symbol cache */
+
+// set the directory the symbol caches are kept in
+void cache_set_dir(const char *dir);
+
+// load the symbol tables of a binary from its cache
+int cache_load(const char *file);
+
+// save the symbol tables of a binary to its cache
+int cache_save(const char *file);
+
 /**********************************************************************/
 
 /* Lua utility functions. */
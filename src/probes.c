@@ -21,6 +21,17 @@
 // List of "active" probes
 probe_t     *probes_list;
 
+// Probes whose symbols have not been found yet, e.g. because they live
+// in a shared library that has not been loaded.
+typedef struct pending_t pending_t;
+struct pending_t
+{
+    char       name[256];
+    pending_t *next;
+};
+
+static pending_t *pending_list;
+
 // Regular expressions to parse probe array index descriptions
 static regex_t probe_re_arrind;
 static regex_t probe_re_structmem;
@@ -148,6 +159,184 @@ static int _set_probe_type(probe_t *p, char *name, char **pvar, char **ref) {
     return 1;
 }
 
+// collect the names of the symbols that the probe @p name refers to
+// without looking them up, so that we know which symbols to load
+// before the symbol tables exist. Returns the number of names stored
+// in @p syms; the caller frees them.
+int
+get_probe_symbols(char *name, char **syms, int max)
+{
+    int i, n = 0;
+    char *pvar = NULL, *ref = NULL, *name_, *sym;
+    regmatch_t matches[4];
+    probe_t p;
+
+    name_ = strdup(name);
+    if (!name_)
+        return -1;
+    _set_probe_type(&p, name_, &pvar, &ref);
+    free(name_);
+    free(ref);
+
+    if (pvar && (n < max))
+        syms[n++] = pvar;
+    else
+        free(pvar);
+
+    // the dynamic bounds of an array probe are variables too.
+    if (is_arr_ind(p.type) && !regexec(&probe_re_arrind, name, 4, matches, 0)) {
+        for (i = 2; i < 4; i++) {
+            if (matches[i].rm_so == matches[i].rm_eo)
+                continue;
+            sym = strndup(name+matches[i].rm_so,
+                          matches[i].rm_eo-matches[i].rm_so);
+            if (!sym || _str_is_digit(sym) || (n == max))
+                free(sym);
+            else
+                syms[n++] = sym;
+        }
+    }
+    return n;
+}
+
+// the types of the values of the builtin and address probes
+static basetype_t tick_type = { 0, OHM_TYPE_INT, "int", sizeof(int), 1, NULL };
+static basetype_t addr_type = { 0, OHM_TYPE_ULONG, "unsigned long",
+                                sizeof(addr_t), 1, NULL };
+
+static int
+_plan_add_field(read_plan_t *rp, basetype_t *type, size_t off, const char *name)
+{
+    plan_field_t *f;
+
+    f = realloc(rp->fields, (rp->nfields + 1) * sizeof(*f));
+    if (!f) {
+        derror("unable to allocate memory.");
+        return -1;
+    }
+    rp->fields = f;
+    f = &rp->fields[rp->nfields++];
+    f->type = type;
+    f->off = off;
+    f->name = name;
+    return 0;
+}
+
+// add the fields to decode a value of type "t", or "nelem" elements
+// of it if it is an array, at the start of the buffer
+static int
+_plan_add_fields(read_plan_t *rp, basetype_t *t, int nelem)
+{
+    basetype_t *ot;
+    size_t off;
+    int i;
+
+    t = get_type_alias(t);
+    if (is_array(t->ohm_type)) {
+        ot = get_type_alias(t->elems[0]);
+        rp->table = (nelem > 1);
+        for (i = 0; i < nelem; i++)
+            if (_plan_add_field(rp, ot, i * get_type_size(ot), NULL) < 0)
+                return -1;
+    } else if (is_struct(t->ohm_type)) {
+        rp->table = true;
+        for (i = 0, off = 0; i < get_type_nelem(t); i++) {
+            ot = get_type_alias(t->elems[i]);
+            if (_plan_add_field(rp, ot, off, t->elems[i]->name) < 0)
+                return -1;
+            off += t->elems[i]->size;
+        }
+    } else
+        return _plan_add_field(rp, t, 0, NULL);
+    return 0;
+}
+
+// work out how to read a probe. "member" is the type of the member
+// that a struct member probe refers to.
+static int
+_make_read_plan(probe_t *p, basetype_t *member)
+{
+    read_plan_t *rp = &p->plan;
+    plan_step_t *st = rp->steps;
+    basetype_t *t, *ot;
+    size_t size, elem_size;
+    unsigned int i;
+    int nelem;
+    char *buf;
+
+    free(rp->fields);
+    memset(rp, 0, sizeof(*rp));
+    rp->start = p->start;
+    rp->num = p->num;
+
+    if (is_cur_tick(p->type)) {
+        st[rp->nsteps++] = (plan_step_t){ OHM_PLAN_TICK, 0, sizeof(int) };
+        return _plan_add_field(rp, &tick_type, 0, NULL);
+    } else if (is_ptr_addr(p->type)) {
+        st[rp->nsteps++] = (plan_step_t){ OHM_PLAN_ADDRESS, 0, sizeof(addr_t) };
+        return _plan_add_field(rp, &addr_type, 0, NULL);
+    } else if (!p->var || !p->var->type)
+        return 0;
+
+    t = get_type_alias(p->var->type);
+    size = get_type_size(t);
+    st[rp->nsteps++] = (plan_step_t){ OHM_PLAN_LOCATION, 0, size };
+
+    if (is_array(t->ohm_type)) {
+        ot = get_type_alias(t->elems[0]);
+        elem_size = get_type_size(ot);
+        nelem = (p->num < 0) ? (get_type_nelem(t)-p->start) : p->num+1;
+        if (is_arr_ind(p->type)) {
+            if ((p->start < 0) || (nelem <= 0) ||
+                (size < ((p->start+nelem) * elem_size))) {
+                ddebug("skipping probe %s: array index out of bounds",
+                       p->name);
+                rp->nsteps = 0;
+                return 0;
+            }
+            st[0].off = p->start * elem_size;
+            st[0].len = nelem * elem_size;
+        } else
+            nelem = get_type_nelem(t);
+        if (_plan_add_fields(rp, t, nelem) < 0)
+            return -1;
+    } else if (is_deref(p->type) && is_ptr(t->ohm_type) && t->elems[0]) {
+        ot = get_type_alias(t->elems[0]);
+        st[rp->nsteps++] = (plan_step_t){ OHM_PLAN_POINTER, 0, get_type_size(ot) };
+        if (_plan_add_fields(rp, ot, get_type_nelem(ot)) < 0)
+            return -1;
+    } else if (is_struct_mem(p->type) && is_ptr(t->ohm_type) && t->elems[0]
+               && member) {
+        st[rp->nsteps++] = (plan_step_t){ OHM_PLAN_POINTER, p->start, p->num };
+        if (_plan_add_fields(rp, member, get_type_nelem(member)) < 0)
+            return -1;
+    } else if (_plan_add_fields(rp, t, get_type_nelem(t)) < 0)
+        return -1;
+
+    // make room for the largest of the reads
+    for (i = 0, size = 0; i < rp->nsteps; i++)
+        if (st[i].len > size)
+            size = st[i].len;
+    if (size > p->bufsize) {
+        buf = realloc(p->buf, size);
+        if (!buf) {
+            derror("unable to allocate memory.");
+            return -1;
+        }
+        p->buf = buf;
+        p->bufsize = size;
+    }
+    return 0;
+}
+
+// work out the read plan of an array probe again after its dynamic
+// bounds changed.
+int
+update_read_plan(probe_t *p)
+{
+    return _make_read_plan(p, NULL);
+}
+
 // activate a probe and allocate a buffer for it given the following
 // arguments:
 //
@@ -183,7 +372,9 @@ static int _activate_probe(probe_t *p, variable_t *var, bool active, char *ref)
         ddebug("could not figure out the type size. Skipping probe %s...", p->name);
         return -1;
     }
+    p->bufsize = ts;
 
+    basetype_t *member = NULL;
     if (is_struct_mem(p->type)) {
         p->start = 0;
         basetype_t *type = get_type_ptr(var->type);
@@ -192,13 +383,19 @@ static int _activate_probe(probe_t *p, variable_t *var, bool active, char *ref)
             for (i = 0; i < get_type_nelem(type); ++i) {
                 if (!strcmp(ref, type->elems[i]->name)) {
                     p->num = type->elems[i]->size;
+                    member = type->elems[i];
                     break;
                 }
                 p->start += type->elems[i]->size;
             }
         }
     }
-    
+
+    if (_make_read_plan(p, member) < 0) {
+        free(p->buf);
+        return -1;
+    }
+
     p->status = active;
     p->next = NULL;
     return 1;
@@ -279,6 +476,65 @@ probes_list_add(probe_t **table, probe_t *probe)
 
 //TODO: probes_list_remove
 
+// remember a probe whose symbols are not loaded yet
+int
+add_pending_probe(char *name)
+{
+    pending_t *p;
+
+    p = calloc(1, sizeof(*p));
+    if (!p) {
+        derror("unable to allocate memory.");
+        return -1;
+    }
+    strncpy(p->name, name, sizeof(p->name)-1);
+    p->next = pending_list;
+    pending_list = p;
+    return 0;
+}
+
+// check if there are any probes waiting for their symbols
+bool
+probes_pending(void)
+{
+    return (pending_list != NULL);
+}
+
+// try to activate the pending probes again, after the symbols of
+// another object have been loaded. Returns the number of probes that
+// were activated.
+int
+activate_pending_probes(probe_t **table)
+{
+    int n = 0;
+    pending_t **pp = &pending_list, *p;
+    probe_t *probe;
+
+    while ((p = *pp) != NULL) {
+        probe = new_probe(p->name);
+        if (!probe || (probes_list_add(table, probe) < 0)) {
+            pp = &p->next;
+            continue;
+        }
+        ddebug("activated probe %s.", p->name);
+        *pp = p->next;
+        free(p);
+        n++;
+    }
+    return n;
+}
+
+// check whether a probe can only be read while the target is stopped.
+// The locations of all but the global variables depend on the
+// registers of the target: on its stack, or on its thread pointer.
+bool
+probe_needs_stop(probe_t *p)
+{
+    return (p->var && is_locexpr(p->var->loctype)) ||
+        (p->lower && is_locexpr(p->lower->loctype)) ||
+        (p->upper && is_locexpr(p->upper->loctype));
+}
+
 // print all the active probes
 void
 print_probes(probe_t *probe)
@@ -288,9 +544,12 @@ print_probes(probe_t *probe)
             if (is_addr(probe->var->loctype))
                 ddebug("%s(0x%lx)\t[GLOBAL]", probe->name,
                        probe->var->addr);
+            else if (probe->var->function)
+                ddebug("%s(+%lu)\t[STACK]", probe->name,
+                       (unsigned long)probe->var->offset);
             else
-                ddebug("%s(%ld)\t[STACK]", probe->name,
-                       probe->var->offset);
+                ddebug("%s(+%lu)\t[COMPUTED]", probe->name,
+                       (unsigned long)probe->var->offset);
         }
         probe = probe->next;
     }
@@ -0,0 +1,254 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ohmd.h"
+
+// The probes are kept in a hierarchical timer wheel, by when they are
+// next due. The first level has a slot for each of the next 64 ticks,
+// and each level above it a slot for 64 slots of the level below. As
+// time goes on, the probes of a slot of an upper level are moved down
+// once the first level comes around to it. Adding a probe and finding
+// the probes due at a tick take constant time, however many probes
+// there are and however far apart their rates are.
+#define OHM_SCHED_BITS      6
+#define OHM_SCHED_SLOTS     (1 << OHM_SCHED_BITS)
+#define OHM_SCHED_MASK      (OHM_SCHED_SLOTS - 1)
+#define OHM_SCHED_LEVELS    4
+
+// the furthest a probe can be scheduled ahead, about half an hour
+#define OHM_SCHED_MAX       ((1ULL << (OHM_SCHED_BITS * OHM_SCHED_LEVELS)) - 1)
+
+static probe_t         *wheel[OHM_SCHED_LEVELS][OHM_SCHED_SLOTS];
+static uint64_t         wheel_now;      // the next tick to run
+static struct timespec  sched_start;
+
+// The lateness of the samples is kept in a histogram with 16 buckets
+// for each power of two nanoseconds, which is within 6% of the actual
+// value at any scale.
+#define OHM_HIST_SUB_BITS   4
+#define OHM_HIST_BUCKETS    (64 << OHM_HIST_SUB_BITS)
+
+static uint64_t lateness_hist[OHM_HIST_BUCKETS];
+static uint64_t lateness_count;
+static uint64_t lateness_max;
+
+void
+sched_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &sched_start);
+    memset(wheel, 0, sizeof(wheel));
+    wheel_now = 0;
+}
+
+uint64_t
+sched_now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)(t.tv_sec - sched_start.tv_sec) * 1000000000ULL +
+        t.tv_nsec - sched_start.tv_nsec;
+}
+
+uint64_t
+sched_now(void)
+{
+    return sched_now_ns() / OHM_SCHED_TICK_NS;
+}
+
+// Sleeping until a deadline rather than for a while keeps the time it
+// takes to sample the probes from adding up over the periods. The
+// sleep is cut short by signals.
+void
+sched_sleep_until(uint64_t tick)
+{
+    struct timespec t;
+    uint64_t ns = tick * OHM_SCHED_TICK_NS + sched_start.tv_nsec;
+
+    t.tv_sec = sched_start.tv_sec + ns / 1000000000ULL;
+    t.tv_nsec = ns % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
+
+static unsigned int
+_hist_bucket(uint64_t v)
+{
+    unsigned int msb;
+
+    if (v < (1U << OHM_HIST_SUB_BITS))
+        return v;
+    msb = 63 - __builtin_clzll(v);
+    return ((msb - OHM_HIST_SUB_BITS + 1) << OHM_HIST_SUB_BITS) +
+        ((v >> (msb - OHM_HIST_SUB_BITS)) & ((1U << OHM_HIST_SUB_BITS) - 1));
+}
+
+static uint64_t
+_hist_value(unsigned int b)
+{
+    unsigned int e = b >> OHM_HIST_SUB_BITS;
+
+    if (!e)
+        return b;
+    return ((uint64_t)((1U << OHM_HIST_SUB_BITS) | (b & ((1U << OHM_HIST_SUB_BITS) - 1))))
+        << (e - 1);
+}
+
+void
+sched_record_lateness(uint64_t ns)
+{
+    lateness_hist[_hist_bucket(ns)]++;
+    lateness_count++;
+    if (ns > lateness_max)
+        lateness_max = ns;
+}
+
+void
+sched_report(void)
+{
+    static const double pct[] = { 50, 90, 99, 99.9 };
+    uint64_t n = 0, want;
+    unsigned int b, i = 0;
+
+    if (!lateness_count)
+        return;
+    fprintf(stderr, "sampling lateness over %llu samples (us):",
+            (unsigned long long)lateness_count);
+    for (b = 0; (b < OHM_HIST_BUCKETS) && (i < sizeof(pct)/sizeof(pct[0])); b++) {
+        n += lateness_hist[b];
+        while ((i < sizeof(pct)/sizeof(pct[0])) &&
+               (n >= (want = (uint64_t)(pct[i] / 100 * lateness_count + 0.5))) &&
+               want)
+            fprintf(stderr, " p%g %.1f", pct[i++], _hist_value(b) / 1E3);
+    }
+    fprintf(stderr, " max %.1f\n", lateness_max / 1E3);
+}
+
+static void
+_insert(probe_t *p)
+{
+    uint64_t expires = p->expires, delta;
+    unsigned int level, slot;
+
+    if (expires < wheel_now)
+        expires = wheel_now;
+    delta = expires - wheel_now;
+    if (delta > OHM_SCHED_MAX)
+        expires = wheel_now + OHM_SCHED_MAX;
+
+    for (level = 0; level < OHM_SCHED_LEVELS - 1; level++)
+        if (delta < (1ULL << (OHM_SCHED_BITS * (level + 1))))
+            break;
+    slot = (expires >> (OHM_SCHED_BITS * level)) & OHM_SCHED_MASK;
+    p->wnext = wheel[level][slot];
+    wheel[level][slot] = p;
+}
+
+void
+sched_add(probe_t *p, double period)
+{
+    p->period = period * 1E9 / OHM_SCHED_TICK_NS;
+    if (!p->period)
+        p->period = 1;
+    p->expires = sched_now();
+    p->due = false;
+    _insert(p);
+}
+
+// move the probes of a slot of an upper level to the levels below
+static void
+_cascade(unsigned int level, unsigned int slot)
+{
+    probe_t *p, *next;
+
+    p = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    for (; p; p = next) {
+        next = p->wnext;
+        _insert(p);
+    }
+}
+
+// run the tick "wheel_now"
+static int
+_tick(void)
+{
+    unsigned int level, slot = wheel_now & OHM_SCHED_MASK;
+    probe_t *p, *next;
+    int n = 0;
+
+    for (level = 1; !slot && (level < OHM_SCHED_LEVELS); level++) {
+        slot = (wheel_now >> (OHM_SCHED_BITS * level)) & OHM_SCHED_MASK;
+        _cascade(level, slot);
+    }
+
+    slot = wheel_now & OHM_SCHED_MASK;
+    p = wheel[0][slot];
+    wheel[0][slot] = NULL;
+    for (; p; p = next) {
+        next = p->wnext;
+        // probes that were pushed back by the limit of the wheel
+        if (p->expires > wheel_now) {
+            _insert(p);
+            continue;
+        }
+        p->due = true;
+        n++;
+
+        // the next sample is due a period after this one was, rather
+        // than after we got to it. Samples we were too late for are
+        // skipped.
+        p->expires += p->period;
+        if (p->expires <= wheel_now)
+            p->expires = wheel_now + p->period -
+                ((wheel_now - p->expires) % p->period);
+        _insert(p);
+    }
+    wheel_now++;
+    return n;
+}
+
+int
+sched_advance(uint64_t now)
+{
+    int n = 0;
+
+    while (wheel_now <= now)
+        n += _tick();
+    return n;
+}
+
+uint64_t
+sched_next(void)
+{
+    uint64_t next = wheel_now + OHM_SCHED_MAX;
+    unsigned int level, i, slot;
+    probe_t *p;
+
+    // the earliest probe of a level is in its first slot that is not
+    // empty, after the current one. The current slot of the upper
+    // levels has only the probes due a whole turn of it later.
+    for (level = 0; level < OHM_SCHED_LEVELS; level++) {
+        slot = (wheel_now >> (OHM_SCHED_BITS * level)) & OHM_SCHED_MASK;
+        for (i = !!level; i < OHM_SCHED_SLOTS + !!level; i++) {
+            p = wheel[level][(slot + i) & OHM_SCHED_MASK];
+            if (!p)
+                continue;
+            for (; p; p = p->wnext)
+                if (p->expires < next)
+                    next = p->expires;
+            break;
+        }
+    }
+    return (next < wheel_now) ? wheel_now : next;
+}
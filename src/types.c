@@ -16,35 +16,191 @@
 
 #include "ohmd.h"
 
-// Basetype table
-basetype_t   types_table[OHM_MAX_NUM_TYPES];
-unsigned int types_table_size;
+// Basetype table. The types themselves live in an arena so that
+// pointers to them stay valid as the table grows.
+OHM_TLS basetype_t **types_table;
+OHM_TLS unsigned int types_table_size;
+static OHM_TLS unsigned int types_table_cap;
+static OHM_TLS ohm_arena_t  types_arena;
+
+// Types before this index have been resolved already.
+static OHM_TLS unsigned int types_resolved;
+
+// The DIE offsets of different objects overlap, so the types of the
+// object being scanned get this added to their ids.
+OHM_TLS Dwarf_Off types_id_base;
+
+// Open-addressing index over the basetype table keyed by the global
+// DIE offset of the type. The key is kept in the slot so that a lookup
+// does not touch the types themselves.
+typedef struct type_slot_t type_slot_t;
+struct type_slot_t
+{
+    Dwarf_Off   id;
+    basetype_t *type;    // NULL if the slot is empty.
+};
+
+static OHM_TLS type_slot_t  *types_index;
+static OHM_TLS unsigned int  types_index_bits;
+
+static inline unsigned int
+_type_slot(Dwarf_Off id, unsigned int bits)
+{
+    // Fibonacci hashing spreads the (mostly sequential) DIE offsets
+    // over the index.
+    return (unsigned int)((id * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static void
+_types_index_insert(basetype_t *t)
+{
+    unsigned int mask = (1U << types_index_bits) - 1;
+    unsigned int slot = _type_slot(t->id, types_index_bits);
+
+    while (types_index[slot].type)
+        slot = (slot + 1) & mask;
+    types_index[slot].id = t->id;
+    types_index[slot].type = t;
+}
+
+// double the size of the index, keeping it at most half full.
+static int
+_types_index_grow(void)
+{
+    unsigned int i;
+    type_slot_t *index;
+    unsigned int bits = types_index_bits ? types_index_bits + 1 : 10;
+
+    index = calloc(1U << bits, sizeof(*index));
+    if (!index) {
+        derror("unable to allocate memory.");
+        return -1;
+    }
+    free(types_index);
+    types_index = index;
+    types_index_bits = bits;
+
+    for (i = 0; i < types_table_size; i++)
+        _types_index_insert(types_table[i]);
+    return 0;
+}
 
 // fetch a basetype for an object given its id
 basetype_t*
-get_type(int id)
+get_type(Dwarf_Off id)
 {
-    int i;
-    for (i = 0; i < types_table_size; i++) {
-        if (id == types_table[i].id)
-            return &types_table[i];
+    unsigned int slot, mask;
+
+    if (!types_index)
+        return NULL;
+
+    mask = (1U << types_index_bits) - 1;
+    for (slot = _type_slot(id, types_index_bits); types_index[slot].type;
+         slot = (slot + 1) & mask) {
+        if (id == types_index[slot].id)
+            return types_index[slot].type;
     }
     return NULL;
 }
 
+// append a type to the table and the index
+static int
+_types_table_push(basetype_t *t)
+{
+    basetype_t **table;
+
+    if (((types_table_size + 1) << 1) > (1U << types_index_bits))
+        if (_types_index_grow() < 0)
+            return -1;
+
+    if (types_table_size == types_table_cap) {
+        table = ohm_grow(types_table, &types_table_cap, sizeof(*table));
+        if (!table)
+            return -1;
+        types_table = table;
+    }
+
+    types_table[types_table_size++] = t;
+    _types_index_insert(t);
+    return 0;
+}
+
 basetype_t*
-get_or_add_type(int id)
+get_or_add_type(Dwarf_Off id)
 {
     basetype_t *t;
+    id |= types_id_base;
     t = get_type(id);
     if (!t) {
-        t = &types_table[types_table_size++];
+        t = ohm_alloc(&types_arena, sizeof(*t));
+        if (!t)
+            return NULL;
         t->id = id;
         t->size = 0;
+        t->name = "";
+        if (_types_table_push(t) < 0)
+            return NULL;
     }
     return t;
 }
 
+// hand the types table of this thread over to "s".
+void
+export_types(symbols_t *s)
+{
+    s->types = types_table;
+    s->ntypes = types_table_size;
+
+    types_table = NULL;
+    types_table_size = 0;
+    types_table_cap = 0;
+    free(types_index);
+    types_index = NULL;
+    types_index_bits = 0;
+}
+
+// merge the types found by another thread. A type is defined in the
+// compile unit that contains its DIE, so at most one thread has its
+// definition; the others only have a placeholder for it.
+int
+merge_types(symbols_t *s)
+{
+    unsigned int i;
+    basetype_t *t, *e;
+
+    for (i = 0; i < s->ntypes; i++) {
+        t = s->types[i];
+        e = get_type(t->id);
+        if (!e) {
+            if (_types_table_push(t) < 0)
+                return -1;
+        } else if (!e->ohm_type && t->ohm_type)
+            *e = *t;
+    }
+    free(s->types);
+    s->types = NULL;
+    s->ntypes = 0;
+    return 0;
+}
+
+// point the elements of all types at the merged copies of the types.
+void
+relink_types(void)
+{
+    unsigned int i, j, n;
+    basetype_t *t;
+
+    for (i = 0; i < types_table_size; i++) {
+        t = types_table[i];
+        if (!t->elems)
+            continue;
+        n = is_struct(t->ohm_type) ? t->nelem : 1;
+        for (j = 0; j < n; j++)
+            if (t->elems[j])
+                t->elems[j] = get_type(t->elems[j]->id);
+    }
+}
+
 inline size_t
 get_type_size(basetype_t *type)
 {
@@ -146,16 +302,20 @@ get_type_ohmtype(basetype_t *type)
     }
 }
 
-static int
+// add a struct member to the struct type that encloses it. Members are
+// visited right after their struct during the traversal, so they are
+// appended to its list of elements in declaration order.
+int
 add_structmember_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
 {
     int ret = DW_DLV_ERROR;
     Dwarf_Error err = 0;
     Dwarf_Half tag = 0;
-    Dwarf_Off offset = 0;
+    Dwarf_Off offset = 0, poffset = 0;
     Dwarf_Unsigned tid = 0;
     Dwarf_Unsigned loc = 0;
-    basetype_t *t, *t2;
+    basetype_t *t, *s, **elems;
+    char name[128];
 
     ret = dwarf_tag(die, &tag, &err);
     if (ret != DW_DLV_OK) {
@@ -163,9 +323,20 @@ add_structmember_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
         goto error;
     }
 
-    if (tag != DW_TAG_member)
+    if (tag != DW_TAG_member || !parent_die)
+        return -1;
+
+    // we only know how to read members of structs.
+    ret = dwarf_tag(parent_die, &tag, &err);
+    if (ret != DW_DLV_OK || tag != DW_TAG_structure_type)
         return -1;
 
+    ret = dwarf_dieoffset(parent_die, &poffset, &err);
+    if (ret != DW_DLV_OK) {
+        derror("error in dwarf_dieoffset()");
+        goto error;
+    }
+
     ret = get_offset_tid(die, &offset, &tid);
     if (ret < 0) {
         derror("error in get_offset_tid()");
@@ -173,9 +344,12 @@ add_structmember_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
     }
 
     t = get_or_add_type(offset);
-    ret = get_child_name(dbg, die, t->name, 128);
-    if (ret < 0)
-        strncpy(t->name, "<unknown-structmbr>", 128);
+    s = get_or_add_type(poffset);
+    if (!t || !s)
+        goto error;
+
+    ret = get_child_name(dbg, die, name, sizeof(name));
+    t->name = ohm_intern((ret < 0) ? "<unknown-structmbr>" : name);
     t->ohm_type = OHM_TYPE_ALIAS;
     ret = get_member_location(die, &loc);
     if (ret < 0) {
@@ -183,13 +357,19 @@ add_structmember_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
         goto error;
     }
     // this is the struct member location and not the size; we will
-    // fix it later in refresh_compound_sizes.
+    // fix it later in resolve_types.
     t->size = loc;
-
-    t2 = get_or_add_type(tid);
     t->nelem = 1;
     t->elems = malloc(sizeof(t));
-    t->elems[0] = t2;
+    t->elems[0] = get_or_add_type(tid);
+
+    elems = realloc(s->elems, (s->nelem+1)*sizeof(t));
+    if (!elems) {
+        derror("unable to allocate memory.");
+        goto error;
+    }
+    s->elems = elems;
+    s->elems[s->nelem++] = t;
     return 1;
 
 error:
@@ -197,7 +377,6 @@ error:
     return -1;
 }
 
-
 int
 add_basetype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
 {
@@ -206,13 +385,14 @@ add_basetype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
     Dwarf_Off offset = 0;
     Dwarf_Unsigned bsz = 0;
     basetype_t *t;
+    char name[128];
 
     if (is_base_type(die) != 1)
         return -1;
 
-    ret = dwarf_die_CU_offset(die, &offset, &err);
+    ret = dwarf_dieoffset(die, &offset, &err);
     if (ret != DW_DLV_OK) {
-        derror("error in dwarf_die_CU_offset()");
+        derror("error in dwarf_dieoffset()");
         goto error;
     }
 
@@ -226,7 +406,11 @@ add_basetype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
      * later to find the types of some of the probes on the stack. */
 
     t = get_or_add_type(offset);
-    get_child_name(dbg, die, t->name, 128);
+    if (!t)
+        goto error;
+    if (get_child_name(dbg, die, name, sizeof(name)) < 0)
+        name[0] = 0;
+    t->name = ohm_intern(name);
     t->ohm_type = get_type_ohmtype(t);
     t->size = bsz;
     t->nelem = 1;
@@ -241,7 +425,7 @@ error:
 int
 add_complextype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
 {
-    int ret = DW_DLV_ERROR, i, nsib;
+    int ret = DW_DLV_ERROR;
     Dwarf_Error err = 0;
     Dwarf_Off offset = 0;
     Dwarf_Half tag = 0;
@@ -249,6 +433,7 @@ add_complextype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
     Dwarf_Unsigned bsz = 0, tid = 0;
     Dwarf_Die grandchild;
     basetype_t *t, *t2;
+    char name[128];
 
     ret = dwarf_tag(die, &tag, &err);
     if (ret != DW_DLV_OK) {
@@ -280,39 +465,40 @@ add_complextype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
                 return 0;
 
             t = get_or_add_type(offset);
-            snprintf(t->name, 128, "arr%u[]", (unsigned int)offset);
+            if (!t)
+                goto error;
+            snprintf(name, sizeof(name), "arr%lu[]", (unsigned long)offset);
+            t->name = ohm_intern(name);
             t->ohm_type = OHM_TYPE_ARRAY;
             t->nelem = bsz+1;
+            // the element type might not have been seen yet; the size
+            // is computed in resolve_types.
             t2 = get_or_add_type(tid);
-            t->size = t->nelem * get_type_size(t2);
+            t->size = 0;
             t->elems = malloc(sizeof(t));
             t->elems[0] = t2;
             break;
 
         case DW_TAG_structure_type:
-            ret = dwarf_die_CU_offset(die, &offset, &err);
+            ret = dwarf_dieoffset(die, &offset, &err);
             if (ret != DW_DLV_OK) {
-                derror("error in dwarf_die_CU_offset()");
+                derror("error in dwarf_dieoffset()");
                 goto error;
             }
 
             t = get_or_add_type(offset);
-            strncpy(t->name, "struct ", 7);
-            ret = get_child_name(dbg, die, t->name+7, 128);
-            if (ret < 0)
-                strncpy(t->name, "<unknown-struct>", 128);
+            if (!t)
+                goto error;
+            strcpy(name, "struct ");
+            ret = get_child_name(dbg, die, name+7, sizeof(name)-7);
+            t->name = ohm_intern((ret < 0) ? "<unknown-struct>" : name);
             t->ohm_type = OHM_TYPE_STRUCT;
             ret = dwarf_bytesize(die, &bsz, &err);
             t->size = ((ret == DW_DLV_OK) ? bsz : 0);
 
-            // ensure that struct members get added to the table
-            nsib = traverse_die(&add_structmember_from_die, dbg, parent_die, die);
-            if (nsib < 0)
-                goto error;
-            t->nelem = nsib;
-            t->elems = malloc((t->nelem)*sizeof(t));
-            for (i = 0; i < t->nelem; i++)
-                t->elems[i] = &types_table[types_table_size-t->nelem-1+i];
+            // the members are added as we visit them.
+            t->nelem = 0;
+            t->elems = NULL;
             break;
 
         case DW_TAG_typedef:
@@ -323,15 +509,16 @@ add_complextype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
             }
 
             t = get_or_add_type(offset);
+            if (!t)
+                goto error;
             t->ohm_type = OHM_TYPE_ALIAS;
             t->size = 0;
             t->nelem = 1;
             t2 = get_or_add_type(tid);
             t->elems = malloc(sizeof(t));
             t->elems[0] = t2;
-            ret = get_child_name(dbg, die, t->name, 128);
-            if (ret < 0)
-                strncpy(t->name, "<unknown-typedef>", 128);
+            ret = get_child_name(dbg, die, name, sizeof(name));
+            t->name = ohm_intern((ret < 0) ? "<unknown-typedef>" : name);
             break;
 
         case DW_TAG_pointer_type:
@@ -342,12 +529,13 @@ add_complextype_from_die(Dwarf_Debug dbg, Dwarf_Die parent_die, Dwarf_Die die)
             }
 
             t = get_or_add_type(offset);
-            strncpy(t->name, "ptr", 128);
+            if (!t)
+                goto error;
+            t->name = ohm_intern("ptr");
             t->ohm_type = OHM_TYPE_PTR;
             t->nelem = 1;
             t->size = sizeof(void*);
-            t2 = get_type(tid);
-            t->size = get_type_size(t2);
+            t2 = tid ? get_or_add_type(tid) : NULL;
             t->elems = malloc(sizeof(t));
             t->elems[0] = t2;
             break;
@@ -363,25 +551,57 @@ error:
     return -1;
 }
 
+// compute the size of a type whose element types might have been
+// defined after it.
+static size_t
+_resolve_size(basetype_t *t)
+{
+    if (!t)
+        return 0;
+
+    if (is_alias(t->ohm_type) && t->elems)
+        return _resolve_size(t->elems[0]);
+
+    if (is_array(t->ohm_type))
+        t->size = t->nelem * _resolve_size(t->elems[0]);
+    else if (is_ptr(t->ohm_type))
+        t->size = _resolve_size(t->elems[0]);
+    return t->size;
+}
+
+// resolve forward type references once all of the types of an object
+// have been loaded. This fixes the sizes of arrays and pointers, and
+// turns the struct member locations into the number of bytes each
+// member spans. Only the types added since the last call are touched.
 void
-refresh_compound_sizes(void) {
-    int c, sz, i, nmemb;
-    basetype_t *t0, *t1;
-    for (c = 0; c < types_table_size; c++) {
-        if (is_array(types_table[c].ohm_type)) {
-            sz = get_type_size(types_table[c].elems[0]);
-            types_table[c].size = types_table[c].nelem * sz;
-        } else if (is_struct(types_table[c].ohm_type)) {
-            nmemb = types_table[c].nelem;
+resolve_types(void)
+{
+    int c, i, nmemb;
+    basetype_t *t, *t0, *t1;
+    for (c = types_resolved; c < types_table_size; c++) {
+        t = types_table[c];
+        if (is_array(t->ohm_type) || is_ptr(t->ohm_type)) {
+            _resolve_size(t);
+        } else if (is_struct(t->ohm_type)) {
+            nmemb = t->nelem;
             if (!nmemb)
                 continue;
             for (i = 0; i < nmemb-1; ++i) {
-                t0 = types_table[c].elems[i];
-                t1 = types_table[c].elems[i+1];
+                t0 = t->elems[i];
+                t1 = t->elems[i+1];
                 t0->size = t1->size - t0->size;
             }
-            t0 = types_table[c].elems[nmemb-1];
-            t0->size = types_table[c].size - t0->size;
+            t0 = t->elems[nmemb-1];
+            t0->size = t->size - t0->size;
         }
     }
+    types_resolved = types_table_size;
+}
+
+// mark all of the types in the table as resolved, e.g. when they were
+// loaded from the symbol cache.
+void
+mark_types_resolved(void)
+{
+    types_resolved = types_table_size;
 }
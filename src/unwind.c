@@ -0,0 +1,282 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <elf.h>
+#include <sys/ptrace.h>
+#include <sys/user.h>
+#include <sys/uio.h>
+#include <libunwind-ptrace.h>
+
+#include "ohmd.h"
+
+// libunwind reads the registers and the stack of the target one word
+// at a time, which through ptrace is a system call each. Instead, we
+// get all of the registers with one PTRACE_GETREGSET, and copy the
+// stack from the stack pointer up in one read, the first time that
+// libunwind asks for them after a stop. The unwind tables are still
+// found by libunwind-ptrace.
+struct unwinder_t
+{
+    void                    *upt;
+    pid_t                    pid;
+    size_t                   depth;
+
+    bool                     regs_valid;
+    struct user_regs_struct  regs;
+
+    bool                     stack_valid;
+    char                    *stack;
+    size_t                   stack_cap;
+    addr_t                   stack_lo;  // the copied part of the stack
+    addr_t                   stack_hi;
+    addr_t                   map_lo;    // the mapping of the stack
+    addr_t                   map_hi;
+};
+
+// leaf functions keep their locals in the red zone below the stack
+// pointer.
+#define OHM_RED_ZONE    128
+
+// where the registers are in user_regs_struct, as numbered in libunwind
+static const size_t reg_offsets[] = {
+    [UNW_X86_64_RAX] = offsetof(struct user_regs_struct, rax),
+    [UNW_X86_64_RDX] = offsetof(struct user_regs_struct, rdx),
+    [UNW_X86_64_RCX] = offsetof(struct user_regs_struct, rcx),
+    [UNW_X86_64_RBX] = offsetof(struct user_regs_struct, rbx),
+    [UNW_X86_64_RSI] = offsetof(struct user_regs_struct, rsi),
+    [UNW_X86_64_RDI] = offsetof(struct user_regs_struct, rdi),
+    [UNW_X86_64_RBP] = offsetof(struct user_regs_struct, rbp),
+    [UNW_X86_64_RSP] = offsetof(struct user_regs_struct, rsp),
+    [UNW_X86_64_R8]  = offsetof(struct user_regs_struct, r8),
+    [UNW_X86_64_R9]  = offsetof(struct user_regs_struct, r9),
+    [UNW_X86_64_R10] = offsetof(struct user_regs_struct, r10),
+    [UNW_X86_64_R11] = offsetof(struct user_regs_struct, r11),
+    [UNW_X86_64_R12] = offsetof(struct user_regs_struct, r12),
+    [UNW_X86_64_R13] = offsetof(struct user_regs_struct, r13),
+    [UNW_X86_64_R14] = offsetof(struct user_regs_struct, r14),
+    [UNW_X86_64_R15] = offsetof(struct user_regs_struct, r15),
+    [UNW_X86_64_RIP] = offsetof(struct user_regs_struct, rip),
+};
+
+unwinder_t *
+unwinder_create(pid_t pid, size_t depth)
+{
+    unwinder_t *u;
+
+    u = calloc(1, sizeof(*u));
+    if (!u) {
+        derror("unable to allocate memory.");
+        return NULL;
+    }
+
+    u->upt = _UPT_create(pid);
+    if (!u->upt) {
+        derror("error creating _UPT-info structure.");
+        free(u);
+        return NULL;
+    }
+    u->pid = pid;
+    u->depth = depth;
+    return u;
+}
+
+void
+unwinder_destroy(unwinder_t *u)
+{
+    if (!u)
+        return;
+    _UPT_destroy(u->upt);
+    free(u->stack);
+    free(u);
+}
+
+void
+unwinder_reset(unwinder_t *u)
+{
+    u->regs_valid = false;
+    u->stack_valid = false;
+}
+
+static int
+_get_regs(unwinder_t *u)
+{
+    struct iovec iov;
+
+    if (u->regs_valid)
+        return 0;
+
+    iov.iov_base = &u->regs;
+    iov.iov_len = sizeof(u->regs);
+    if (ptrace(PTRACE_GETREGSET, u->pid, NT_PRSTATUS, &iov) < 0)
+        return -1;
+    u->regs_valid = true;
+    return 0;
+}
+
+int
+unwinder_get_reg(unwinder_t *u, int reg, addr_t *val)
+{
+    if ((reg < 0) || (reg > UNW_X86_64_RIP) || (_get_regs(u) < 0))
+        return -1;
+    *val = *(unsigned long *)((char *)&u->regs + reg_offsets[reg]);
+    return 0;
+}
+
+int
+unwinder_get_tp(unwinder_t *u, addr_t *val)
+{
+    if (_get_regs(u) < 0)
+        return -1;
+    *val = u->regs.fs_base;
+    return 0;
+}
+
+// copy the stack of the thread, from just below its stack pointer up
+// to the top of the stack or "depth" bytes above it. The mapping the
+// stack is in is only looked up again once the stack pointer leaves it.
+static int
+_get_stack(unwinder_t *u)
+{
+    addr_t sp, lo, hi;
+    char *s;
+
+    if (u->stack_valid)
+        return (u->stack_hi > u->stack_lo) ? 0 : -1;
+    u->stack_valid = true;
+    u->stack_lo = u->stack_hi = 0;
+
+    if (unwinder_get_reg(u, UNW_X86_64_RSP, &sp) < 0)
+        return -1;
+    if (((sp < u->map_lo) || (sp >= u->map_hi)) &&
+        (maps_find(u->pid, sp, &u->map_lo, &u->map_hi) < 0)) {
+        u->map_lo = u->map_hi = 0;
+        return -1;
+    }
+
+    lo = (sp - u->map_lo > OHM_RED_ZONE) ? sp - OHM_RED_ZONE : u->map_lo;
+    hi = (u->map_hi - sp > u->depth) ? sp + u->depth : u->map_hi;
+    if (hi - lo > u->stack_cap) {
+        s = realloc(u->stack, hi - lo);
+        if (!s) {
+            derror("unable to allocate memory.");
+            return -1;
+        }
+        u->stack = s;
+        u->stack_cap = hi - lo;
+    }
+
+    if (mem_read(u->stack, lo, hi - lo) < 0)
+        return -1;
+    u->stack_lo = lo;
+    u->stack_hi = hi;
+    return 0;
+}
+
+static int
+_read_mem(unwinder_t *u, addr_t addr, void *buf, size_t size)
+{
+    if ((_get_stack(u) == 0) && (addr >= u->stack_lo) &&
+        (addr + size <= u->stack_hi)) {
+        memcpy(buf, u->stack + (addr - u->stack_lo), size);
+        return 0;
+    }
+    return mem_read(buf, addr, size);
+}
+
+/**********************************************************************/
+
+// The accessors of libunwind. Anything written to the target goes
+// through ptrace and drops our copies.
+
+static int
+_find_proc_info(unw_addr_space_t as, unw_word_t ip, unw_proc_info_t *pi,
+                int need_unwind_info, void *arg)
+{
+    return _UPT_find_proc_info(as, ip, pi, need_unwind_info,
+                               ((unwinder_t *)arg)->upt);
+}
+
+static void
+_put_unwind_info(unw_addr_space_t as, unw_proc_info_t *pi, void *arg)
+{
+    _UPT_put_unwind_info(as, pi, ((unwinder_t *)arg)->upt);
+}
+
+static int
+_get_dyn_info_list_addr(unw_addr_space_t as, unw_word_t *dilap, void *arg)
+{
+    return _UPT_get_dyn_info_list_addr(as, dilap, ((unwinder_t *)arg)->upt);
+}
+
+static int
+_access_mem(unw_addr_space_t as, unw_word_t addr, unw_word_t *val,
+            int write, void *arg)
+{
+    unwinder_t *u = arg;
+
+    if (write) {
+        u->stack_valid = false;
+        return _UPT_access_mem(as, addr, val, write, u->upt);
+    }
+    return (_read_mem(u, addr, val, sizeof(*val)) < 0)
+        ? -UNW_EINVAL : 0;
+}
+
+static int
+_access_reg(unw_addr_space_t as, unw_regnum_t reg, unw_word_t *val,
+            int write, void *arg)
+{
+    unwinder_t *u = arg;
+    addr_t v;
+
+    if (write) {
+        u->regs_valid = false;
+        return _UPT_access_reg(as, reg, val, write, u->upt);
+    }
+    if (unwinder_get_reg(u, reg, &v) < 0)
+        return -UNW_EBADREG;
+    *val = v;
+    return 0;
+}
+
+static int
+_access_fpreg(unw_addr_space_t as, unw_regnum_t reg, unw_fpreg_t *val,
+              int write, void *arg)
+{
+    return _UPT_access_fpreg(as, reg, val, write, ((unwinder_t *)arg)->upt);
+}
+
+static int
+_resume(unw_addr_space_t as, unw_cursor_t *c, void *arg)
+{
+    unwinder_reset(arg);
+    return _UPT_resume(as, c, ((unwinder_t *)arg)->upt);
+}
+
+static int
+_get_proc_name(unw_addr_space_t as, unw_word_t ip, char *buf, size_t len,
+               unw_word_t *offp, void *arg)
+{
+    return _UPT_get_proc_name(as, ip, buf, len, offp,
+                              ((unwinder_t *)arg)->upt);
+}
+
+unw_accessors_t unwinder_accessors = {
+    .find_proc_info         = _find_proc_info,
+    .put_unwind_info        = _put_unwind_info,
+    .get_dyn_info_list_addr = _get_dyn_info_list_addr,
+    .access_mem             = _access_mem,
+    .access_reg             = _access_reg,
+    .access_fpreg           = _access_fpreg,
+    .resume                 = _resume,
+    .get_proc_name          = _get_proc_name,
+};
@@ -0,0 +1,31 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+// Helpers shared by the unit tests of ohmd. A test is a program that
+// exits with a non-zero status as soon as a check fails.
+
+#ifndef OHM_TEST_H
+#define OHM_TEST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define check(cond) do {                                            \
+    if (!(cond)) {                                                  \
+        fprintf(stderr, "%s:%d: check failed: %s\n",                \
+                __FILE__, __LINE__, #cond);                         \
+        exit(EXIT_FAILURE);                                         \
+    } } while (0)
+
+static inline double
+test_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+#endif
@@ -0,0 +1,248 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+// Compile location descriptions such as libdwarf returns them into
+// location programs, and run them in a fake frame.
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ohmd.h"
+#include "ohm-test.h"
+
+int ohm_debug;
+
+// the registers, frame base and memory of the fake frame
+static addr_t regs[17];
+static addr_t entry_regs[17];
+static char   mem[64];
+#define MEM_BASE 0x1000
+
+static int
+_get_reg(loc_frame_t *f, int reg, addr_t *val)
+{
+    *val = regs[reg];
+    return 0;
+}
+
+static int
+_get_frame_base(loc_frame_t *f, addr_t *val)
+{
+    *val = MEM_BASE + 32;
+    return 0;
+}
+
+static int
+_get_entry_reg(loc_frame_t *f, int reg, addr_t *val)
+{
+    if (!entry_regs[reg])
+        return -1;
+    *val = entry_regs[reg];
+    return 0;
+}
+
+static int
+_read_mem(loc_frame_t *f, addr_t addr, void *buf, size_t size)
+{
+    if (addr < MEM_BASE || addr + size > MEM_BASE + sizeof(mem))
+        return -1;
+    memcpy(buf, mem + (addr - MEM_BASE), size);
+    return 0;
+}
+
+static loc_frame_t frame = {
+    .get_reg = _get_reg,
+    .get_frame_base = _get_frame_base,
+    .get_cfa = _get_frame_base,
+    .read_mem = _read_mem,
+    .get_entry_reg = _get_entry_reg,
+};
+
+// a location description of "n" ops, valid for [lowpc, hipc) if it
+// comes from a location list.
+static Dwarf_Locdesc *
+_locdesc(Dwarf_Loc *ops, int n, int from_loclist, addr_t lowpc, addr_t hipc)
+{
+    static Dwarf_Locdesc lds[8];
+    static int nlds;
+    Dwarf_Locdesc *ld = &lds[nlds++ % 8];
+
+    memset(ld, 0, sizeof(*ld));
+    ld->ld_s = ops;
+    ld->ld_cents = n;
+    ld->ld_from_loclist = from_loclist;
+    ld->ld_lopc = lowpc;
+    ld->ld_hipc = hipc;
+    return ld;
+}
+
+static loclist_t *
+_compile(Dwarf_Locdesc **lds, int n, Dwarf_Addr base)
+{
+    loclist_t *loc;
+    addr_t addr;
+
+    check(compile_locdescs(lds, n, base, &loc, &addr) == 0);
+    return loc;
+}
+
+static void
+test_fixed_address(void)
+{
+    Dwarf_Loc ops[] = { { .lr_atom = DW_OP_addr, .lr_number = 0x601040 } };
+    Dwarf_Locdesc *lds[] = { _locdesc(ops, 1, 0, 0, 0) };
+    loclist_t *loc;
+    addr_t addr = 0;
+
+    check(compile_locdescs(lds, 1, 0, &loc, &addr) == 1);
+    check(addr == 0x601040 && loc == NULL);
+}
+
+// a variable in rbx in the first range, and on the stack in the second
+static void
+test_ranges(void)
+{
+    Dwarf_Loc reg[] = { { .lr_atom = DW_OP_reg3 } };
+    Dwarf_Loc fb[] = { { .lr_atom = DW_OP_fbreg, .lr_number = -16 } };
+    Dwarf_Loc base[] = { { .lr_atom = DW_OP_addr } };
+    Dwarf_Locdesc *lds[] = {
+        _locdesc(reg, 1, 1, 0x10, 0x20),
+        // a base address selection entry
+        _locdesc(base, 0, 1, OHM_LOC_ANYPC_HIGH, 0x1000),
+        _locdesc(fb, 1, 1, 0x20, 0x30),
+    };
+    loclist_t *loc = _compile(lds, 3, 0x400000);
+    loc_value_t val;
+
+    check(loc->nranges == 2);
+    relocate_loclist(loc, 0x10000);
+
+    regs[3] = 42;
+    frame.pc = 0x10000 + 0x400018;
+    check(eval_loclist(loc, &frame, &val) == 0);
+    check(val.npieces == 1 && val.pieces[0].kind == OHM_LOC_VALUE);
+    check(val.pieces[0].val == 42);
+
+    frame.pc = 0x10000 + 0x1020;
+    check(eval_loclist(loc, &frame, &val) == 0);
+    check(val.npieces == 1 && val.pieces[0].kind == OHM_LOC_MEMORY);
+    check(val.pieces[0].val == MEM_BASE + 16);
+
+    frame.pc = 0x10000 + 0x1030;
+    check(eval_loclist(loc, &frame, &val) < 0);
+    frame.pc = 0x400018;
+    check(eval_loclist(loc, &frame, &val) < 0);
+}
+
+// a 16-byte struct with its first half in rax and the other in memory
+static void
+test_pieces(void)
+{
+    Dwarf_Loc ops[] = {
+        { .lr_atom = DW_OP_reg0 },
+        { .lr_atom = DW_OP_piece, .lr_number = 8 },
+        { .lr_atom = DW_OP_breg6, .lr_number = 8 },
+        { .lr_atom = DW_OP_piece, .lr_number = 8 },
+    };
+    Dwarf_Locdesc *lds[] = { _locdesc(ops, 4, 0, 0, 0) };
+    loclist_t *loc = _compile(lds, 1, 0);
+    loc_value_t val;
+    unsigned long v[2], m = 0x1122334455667788UL;
+
+    regs[0] = 7;
+    regs[6] = MEM_BASE;
+    memcpy(mem + 8, &m, sizeof(m));
+    frame.pc = 0x1234;
+    check(eval_loclist(loc, &frame, &val) == 0);
+    check(val.npieces == 2);
+    check(val.pieces[0].kind == OHM_LOC_VALUE && val.pieces[0].size == 8);
+    check(val.pieces[1].kind == OHM_LOC_MEMORY && val.pieces[1].size == 8);
+
+    check(read_loc_value(&val, 0, v, sizeof(v), &frame) == 0);
+    check(v[0] == 7 && v[1] == m);
+    check(read_loc_value(&val, 8, v, 8, &frame) == 0);
+    check(v[0] == m);
+}
+
+// "cond ? 7 : 5", with the targets of the branches as byte offsets
+// into the expression.
+static void
+test_branches(void)
+{
+    Dwarf_Loc ops[] = {
+        { .lr_atom = DW_OP_lit1, .lr_offset = 0 },
+        { .lr_atom = DW_OP_bra, .lr_number = 4, .lr_offset = 1 },
+        { .lr_atom = DW_OP_lit5, .lr_offset = 4 },
+        { .lr_atom = DW_OP_skip, .lr_number = 1, .lr_offset = 5 },
+        { .lr_atom = DW_OP_lit7, .lr_offset = 8 },
+        { .lr_atom = DW_OP_stack_value, .lr_offset = 9 },
+    };
+    Dwarf_Locdesc *lds[] = { _locdesc(ops, 6, 0, 0, 0) };
+    loclist_t *loc;
+    loc_value_t val;
+
+    loc = _compile(lds, 1, 0);
+    check(eval_loclist(loc, &frame, &val) == 0);
+    check(val.pieces[0].kind == OHM_LOC_VALUE && val.pieces[0].val == 7);
+
+    ops[0].lr_atom = DW_OP_lit0;
+    loc = _compile(lds, 1, 0);
+    check(eval_loclist(loc, &frame, &val) == 0);
+    check(val.pieces[0].kind == OHM_LOC_VALUE && val.pieces[0].val == 5);
+}
+
+// DW_OP_entry_value(DW_OP_reg3) + 1 and DW_OP_entry_value(DW_OP_regx 12)
+static void
+test_entry_value(void)
+{
+    unsigned char reg3[] = { DW_OP_reg3 }, regx[] = { DW_OP_regx, 12 };
+    unsigned char breg[] = { DW_OP_breg7, 0 };
+    Dwarf_Loc ops[] = {
+        { .lr_atom = DW_OP_entry_value, .lr_number = sizeof(reg3),
+          .lr_number2 = (Dwarf_Unsigned)(uintptr_t)reg3 },
+        { .lr_atom = DW_OP_plus_uconst, .lr_number = 1 },
+        { .lr_atom = DW_OP_stack_value },
+    };
+    Dwarf_Locdesc *lds[] = { _locdesc(ops, 3, 0, 0, 0) };
+    loclist_t *loc;
+    loc_value_t val;
+
+    entry_regs[3] = 99;
+    loc = _compile(lds, 1, 0);
+    check(eval_loclist(loc, &frame, &val) == 0);
+    check(val.pieces[0].kind == OHM_LOC_VALUE && val.pieces[0].val == 100);
+
+    // the frame does not know the register
+    entry_regs[3] = 0;
+    check(eval_loclist(loc, &frame, &val) < 0);
+
+    entry_regs[12] = 5;
+    ops[0].lr_number = sizeof(regx);
+    ops[0].lr_number2 = (Dwarf_Unsigned)(uintptr_t)regx;
+    loc = _compile(lds, 1, 0);
+    check(eval_loclist(loc, &frame, &val) == 0);
+    check(val.pieces[0].val == 6);
+
+    // only registers are supported
+    ops[0].lr_number = sizeof(breg);
+    ops[0].lr_number2 = (Dwarf_Unsigned)(uintptr_t)breg;
+    loc = _compile(lds, 1, 0);
+    check(eval_loclist(loc, &frame, &val) < 0);
+}
+
+int
+main(void)
+{
+    test_fixed_address();
+    test_ranges();
+    test_pieces();
+    test_branches();
+    test_entry_value();
+    return 0;
+}
@@ -0,0 +1,137 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+// Check the read plans worked out for the probes on pointers, struct
+// members and array slices.
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "ohmd.h"
+#include "ohm-test.h"
+
+int ohm_debug;
+
+// int; long; struct s { int a; long b; }; int[4]; and pointers to them
+static basetype_t int_t  = { 1, OHM_TYPE_INT, "int", sizeof(int), 1, NULL };
+static basetype_t long_t = { 2, OHM_TYPE_LONG, "long", sizeof(long), 1, NULL };
+static basetype_t *a_elems[] = { &int_t }, *b_elems[] = { &long_t };
+static basetype_t mem_a  = { 3, OHM_TYPE_ALIAS, "a", sizeof(int), 1, a_elems };
+static basetype_t mem_b  = { 4, OHM_TYPE_ALIAS, "b", sizeof(long), 1, b_elems };
+static basetype_t *s_elems[] = { &mem_a, &mem_b };
+static basetype_t struct_t = { 5, OHM_TYPE_STRUCT, "struct s",
+                               sizeof(int) + sizeof(long), 2, s_elems };
+static basetype_t *sp_elems[] = { &struct_t }, *ip_elems[] = { &int_t };
+static basetype_t sptr_t = { 6, OHM_TYPE_PTR, "ptr", sizeof(void *), 1, sp_elems };
+static basetype_t iptr_t = { 7, OHM_TYPE_PTR, "ptr", sizeof(void *), 1, ip_elems };
+static basetype_t arr_t  = { 8, OHM_TYPE_ARRAY, "arr8[]", 4 * sizeof(int), 4,
+                             ip_elems };
+
+static void
+_add_var(const char *name, basetype_t *type)
+{
+    variable_t v;
+
+    memset(&v, 0, sizeof(v));
+    v.name = name;
+    v.type = type;
+    v.loctype = OHM_ADDRESS;
+    v.addr = 0x601000;
+    check(add_variable(&v) != NULL);
+}
+
+static void
+_check_step(plan_step_t *st, int src, size_t off, size_t len)
+{
+    check(st->src == src && st->off == off && st->len == len);
+}
+
+// *ip: read the pointer, then the int it points to
+static void
+test_deref(void)
+{
+    probe_t *p = new_probe("*ip");
+    read_plan_t *rp;
+
+    check(p && is_deref(p->type));
+    rp = &p->plan;
+    check(rp->nsteps == 2);
+    _check_step(&rp->steps[0], OHM_PLAN_LOCATION, 0, sizeof(void *));
+    _check_step(&rp->steps[1], OHM_PLAN_POINTER, 0, sizeof(int));
+    check(rp->nfields == 1 && !rp->table);
+    check(rp->fields[0].type == &int_t && rp->fields[0].off == 0);
+    check(p->bufsize >= sizeof(void *));
+}
+
+// *sp: the whole struct, decoded as a table of its members
+static void
+test_deref_struct(void)
+{
+    probe_t *p = new_probe("*sp");
+    read_plan_t *rp;
+
+    check(p);
+    rp = &p->plan;
+    check(rp->nsteps == 2);
+    _check_step(&rp->steps[1], OHM_PLAN_POINTER, 0, struct_t.size);
+    check(rp->table && rp->nfields == 2);
+    check(rp->fields[0].type == &int_t && !strcmp(rp->fields[0].name, "a"));
+    check(rp->fields[1].type == &long_t && !strcmp(rp->fields[1].name, "b"));
+    check(rp->fields[1].off == sizeof(int));
+    check(p->bufsize >= struct_t.size);
+}
+
+// sp->b: only the member, from its offset in the struct
+static void
+test_struct_member(void)
+{
+    probe_t *p = new_probe("sp->b");
+    read_plan_t *rp;
+
+    check(p && is_struct_mem(p->type));
+    rp = &p->plan;
+    check(rp->nsteps == 2);
+    _check_step(&rp->steps[0], OHM_PLAN_LOCATION, 0, sizeof(void *));
+    _check_step(&rp->steps[1], OHM_PLAN_POINTER, sizeof(int), sizeof(long));
+    check(rp->nfields == 1 && rp->fields[0].off == 0);
+}
+
+// arr[1:2]: two elements from the second one on
+static void
+test_array_slice(void)
+{
+    probe_t *p = new_probe("arr[1:2]");
+    read_plan_t *rp;
+
+    check(p && is_arr_ind(p->type));
+    rp = &p->plan;
+    check(rp->nsteps == 1);
+    _check_step(&rp->steps[0], OHM_PLAN_LOCATION, sizeof(int), 2 * sizeof(int));
+    check(rp->table && rp->nfields == 2);
+    check(rp->fields[1].off == sizeof(int));
+
+    // out of bounds
+    p = new_probe("arr[3:9]");
+    check(!p || p->plan.nsteps == 0);
+}
+
+int
+main(void)
+{
+    check(probe_initialize() > 0);
+    _add_var("ip", &iptr_t);
+    _add_var("sp", &sptr_t);
+    _add_var("arr", &arr_t);
+    resolve_variables();
+
+    test_deref();
+    test_deref_struct();
+    test_struct_member();
+    test_array_slice();
+    return 0;
+}
@@ -0,0 +1,71 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+// Check that the timer wheel of the scheduler finds each probe due at
+// the right tick, as the probes move down from the upper levels.
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "ohmd.h"
+#include "ohm-test.h"
+
+int ohm_debug;
+
+// periods, in ticks, around the size of each level of the wheel
+static const uint64_t periods[] = {
+    1, 63, 64, 65, 4095, 4096, 4097, 262145
+};
+
+#define NPROBES     (sizeof(periods) / sizeof(periods[0]))
+#define NTICKS      600000
+
+int
+main(int argc, char *argv[])
+{
+    static probe_t probes[NPROBES];
+    uint64_t start[NPROBES], t, next;
+    unsigned int i, ndue, count[NPROBES];
+    int n;
+
+    sched_init();
+    for (i = 0; i < NPROBES; i++) {
+        memset(&probes[i], 0, sizeof(probes[i]));
+        sched_add(&probes[i], 1.0);
+        probes[i].period = periods[i];
+        start[i] = probes[i].expires;
+        count[i] = 0;
+    }
+
+    for (t = 0; t < NTICKS; t++) {
+        next = ~0ULL;
+        for (i = 0; i < NPROBES; i++)
+            if (probes[i].expires < next)
+                next = probes[i].expires;
+        check(sched_next() == ((next > t) ? next : t));
+
+        n = sched_advance(t);
+        ndue = 0;
+        for (i = 0; i < NPROBES; i++) {
+            check(probes[i].due ==
+                  ((t >= start[i]) && !((t - start[i]) % periods[i])));
+            ndue += probes[i].due;
+            count[i] += probes[i].due;
+            probes[i].due = false;
+        }
+        check(n == (int)ndue);
+    }
+
+    for (i = 0; i < NPROBES; i++)
+        check(count[i] == (NTICKS - 1 - start[i]) / periods[i] + 1);
+
+    // the time jumps ahead: every tick in between is still run
+    n = sched_advance(NTICKS + 9999);
+    check(n > 10000);
+    return 0;
+}
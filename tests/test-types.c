@@ -0,0 +1,57 @@
+// Copyright (c) 2010-2014, Abhishek Kulkarni
+// All rights reserved. This software may be modified
+// and distributed under the terms of the BSD license.
+// See the COPYING file for details.
+
+// Fill the types table with as many types as the synthetic program
+// of misc/gentypes.lua has, and time how long they take to be added
+// and looked up by their DIE offsets.
+
+#if HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "ohmd.h"
+#include "ohm-test.h"
+
+#define NTYPES 100000
+
+int ohm_debug;
+
+// DIE offsets are sparse and mostly increasing.
+static Dwarf_Off
+_offset(unsigned int i)
+{
+    return 0xb + (Dwarf_Off)i * 37;
+}
+
+int
+main(void)
+{
+    unsigned int i;
+    basetype_t *t;
+    double t0, t1, t2;
+
+    t0 = test_now();
+    for (i = 0; i < NTYPES; i++) {
+        t = get_or_add_type(_offset(i));
+        check(t && t->id == _offset(i));
+        t->size = i;
+    }
+    t1 = test_now();
+    for (i = 0; i < NTYPES; i++) {
+        t = get_type(_offset(i));
+        check(t && t->id == _offset(i) && t->size == i);
+    }
+    t2 = test_now();
+
+    check(types_table_size == NTYPES);
+    check(get_or_add_type(_offset(42))->size == 42);
+    check(types_table_size == NTYPES);
+    check(get_type(_offset(NTYPES)) == NULL);
+    check(get_type(_offset(7) + 1) == NULL);
+
+    printf("%d types added in %.3f ms, looked up in %.3f ms.\n",
+           NTYPES, (t1 - t0) * 1E3, (t2 - t1) * 1E3);
+    return 0;
+}